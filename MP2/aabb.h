@@ -30,6 +30,7 @@ class aabb {
         
         virtual bool ray_intersection(const ray& r) const;
         point3 calculate_centroid() const;
+        double surface_area() const;
 
     public:
         point3 minimum;
@@ -80,4 +81,13 @@ point3 aabb::calculate_centroid() const {
     return point3(x, y, z);
 }
 
+/**
+ * Calculates the surface area of the bounding box, used by the SAH builder
+ * @return the total area of all six faces
+ **/
+double aabb::surface_area() const {
+    vec3 extent = maximum - minimum;
+    return 2.0 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+}
+
 #endif
\ No newline at end of file
@@ -6,26 +6,89 @@
 #include "ray.h"
 #include "utils.h"
 #include "aabb.h"
+#include "parallel.h"
+#include "lbvh.h"
 #include <algorithm>
 #include <vector>
 #include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <cmath>
 
 using std::vector;
 
+/** The strategies available for partitioning objects between the two children of a node */
+enum split_method { MIDPOINT, SAH, LBVH };
+
+/**
+ * Settings used when building the BVH tree
+ */
+struct bvh_options {
+    /** how the objects at each node are partitioned */
+    split_method method = MIDPOINT;
+
+    /** number of buckets per axis that the binned SAH builder evaluates */
+    int bins = 12;
+
+    /** cost of visiting a node, relative to leaf_cost */
+    double traversal_cost = 1.0;
+
+    /** cost of intersecting a single object in a leaf */
+    double leaf_cost = 1.0;
+
+    /** the SAH and LBVH builders never create leaves with more objects than this */
+    int max_leaf_size = 4;
+
+    /** number of threads used to build the tree, 0 uses every core */
+    int threads = 0;
+
+    /** bits per Morton code used by the LBVH builder, either 30 or 63 */
+    int morton_bits = 30;
+
+    /** whether to restructure the finished tree by finding the best topology for small treelets */
+    bool optimize_treelets = false;
+
+    /** the number of leaves in each treelet that is restructured, at most 8 */
+    int treelet_size = 7;
+};
+
+/** subtrees with fewer objects than this are always built on the current thread */
+const int parallel_build_threshold = 4096;
+
+/**
+ * An object and its bounding box, computed once before building so the builder
+ * does not have to call bounding_box() at every level of the tree
+ */
+struct bvh_primitive {
+    objs* object;
+    aabb box;
+};
+
 class bvh_node : public objs {
     public: 
-        bvh_node() {};
-        bvh_node(const vector<objs*>& objects);
+        bvh_node() : left(NULL), right(NULL) {};
+        bvh_node(const vector<objs*>& objects, const bvh_options& options = bvh_options());
+
+        bool is_leaf() const {
+            return !primitives.empty();
+        }
 
         virtual color kDiffuse() const;
         virtual vec3 surface_normal(const point3 position) const;
         virtual bool ray_intersection(const ray& r, hit_record& rec) const;
         virtual aabb bounding_box() const;
 
+    private:
+        void build(vector<bvh_primitive>& objs_list, int start, int end, const bvh_options& options, int parallel_depth);
+        void build_lbvh(vector<bvh_primitive>& objs_list, const bvh_options& options, int threads);
+
     public:
         objs* left;
         objs* right;
         aabb bbox;
+
+        /** the objects stored in this node when the SAH builder decides to make it a leaf */
+        vector<objs*> primitives;
 };
 
 /**
@@ -49,6 +112,18 @@ bool bvh_node::ray_intersection(const ray& r, hit_record& rec) const {
         return false;
     }
 
+    if (is_leaf()) {
+        bool hit = false;
+        for (int o = 0; o < (int) primitives.size(); o++) {
+            hit_record tmp;
+            if (primitives[o]->ray_intersection(r, tmp) && (!hit || tmp.t < rec.t)) {
+                rec = tmp;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+
     double hit_left = left->ray_intersection(r, rec);
     double hit_right = right->ray_intersection(r, rec);
 
@@ -83,85 +158,407 @@ bool box_z_compare(const objs* a, const objs* b) {
 }
 
 /**
- * BVH node constructor
- * Recursively creates sub trees for both left and right sides
- * Uses the midpoint method to partition
- * @param objects: the list of objects to separate into subtrees
- * @param start: the starting index of objects to look at
- * @param end: the ending index of objects to look at
+ * Computes the bounds of the centroids of the objects in objs_list[start, end)
+ * @param objs_list: the objects to bound
+ * @param start, end: the range of objects to look at
+ * @param min, max: filled with (xmin, ymin, zmin) and (xmax, ymax, zmax) of the centroids
  */
-bvh_node::bvh_node(const vector<objs*>& objects) {
-    // cerr << "\nnew node: " << objects.size() << "\n";
-    vector<objs*> objs_list = objects;
-    if (objs_list.size() == 0) {
-        return;
+inline void centroid_bounds(const vector<bvh_primitive>& objs_list, int start, int end, double min[3], double max[3]) {
+    bool first = true;
+    for (int o = start; o < end; o++) {
+        point3 centroid = objs_list[o].box.centroid();
+        for (int i = 0; i < 3; i++) {
+            double var = centroid[i];
+            if (first) {
+                min[i] = max[i] = var;
+            } else {
+                if (var < min[i]) {
+                    min[i] = var;
+                }
+                if (var > max[i]) {
+                    max[i] = var;
+                }
+            }
+        }
+        first = false;
     }
-    if (objs_list.size() == 1) {
-        left = right = objs_list[0];
-    } else if (objs_list.size() == 2) {
-        right = objs_list[0];
-        left = objs_list[1];
-    } else {
-        // Compute (xmin, ymin, zmin) and (xmax, ymax, zmax) for centroids
-        double min[3];
-        double max[3];
-        bool first = true;
-        for (int o = 0; o < objs_list.size(); o++) {
-            for (int i = 0; i < 3; i++) {
-                double var = objs_list[o]->bounding_box().centroid()[i];
-                if (first) {
-                    min[i] = max[i] = var;
-                } else {
-                    if (var < min[i]) {
-                        min[i] = var;
-                    }
-                    if (var > max[i]) {
-                        max[i] = var;
-                    }
+}
+
+/**
+ * Partitions objs_list[start, end) in place at the midpoint of the centroid range along the axis with
+ * the largest spread. Splits in half by count when every centroid lands on the same side.
+ * @param objs_list: the objects to partition
+ * @param start, end: the range of objects to partition
+ * @return the index of the first object in the right half
+ */
+inline int midpoint_split(vector<bvh_primitive>& objs_list, int start, int end) {
+    double min[3];
+    double max[3];
+    centroid_bounds(objs_list, start, end, min, max);
+
+    // pick axis based on largest spread
+    int axis = 0;
+    double range = max[0] - min[0];
+    double yrange = max[1] - min[1];
+    double zrange = max[2] - min[2];
+    if (yrange > range) {
+        axis = 1;
+        range = yrange;
+    }
+
+    if (zrange > range) {
+        axis = 2;
+        range = zrange;
+    }
+
+    // sort objects based on median split
+    auto median_split = (max[axis] + min[axis]) / 2;
+    auto mid = std::partition(objs_list.begin() + start, objs_list.begin() + end, [&](const bvh_primitive& o) {
+        return o.box.centroid()[axis] < median_split;
+    });
+
+    int split = mid - objs_list.begin();
+    if (split == start || split == end) {
+        split = start + (end - start) / 2;
+    }
+    return split;
+}
+
+/**
+ * Partitions objs_list[start, end) in place using the binned surface area heuristic. The centroids are
+ * sorted into options.bins buckets along each axis and the bucket boundary with the lowest expected cost is used.
+ * @param objs_list: the objects to partition
+ * @param start, end: the range of objects to partition
+ * @param bounds: the bounding box around all of the objects in the range
+ * @param options: the bin count and costs to evaluate the heuristic with
+ * @return the index of the first object in the right half, or -1 if making a leaf out of all the objects
+ *         is cheaper than splitting them
+ */
+inline int sah_split(vector<bvh_primitive>& objs_list, int start, int end, const aabb& bounds, const bvh_options& options) {
+    double min[3];
+    double max[3];
+    centroid_bounds(objs_list, start, end, min, max);
+
+    int size = end - start;
+    int bins = std::max(options.bins, 2);
+    vector<int> counts(bins);
+    vector<aabb> boxes(bins);
+    vector<int> left_counts(bins);
+    vector<aabb> left_boxes(bins);
+
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = 0;
+    double parent_area = bounds.surface_area();
+
+    for (int axis = 0; axis < 3; axis++) {
+        double range = max[axis] - min[axis];
+        if (range <= 0) {
+            continue;
+        }
+
+        // sort the centroids into buckets
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int o = start; o < end; o++) {
+            const aabb& box = objs_list[o].box;
+            int b = std::min((int) (bins * (box.centroid()[axis] - min[axis]) / range), bins - 1);
+            boxes[b] = counts[b] == 0 ? box : surrounding_box(boxes[b], box);
+            counts[b]++;
+        }
+
+        // sweep from the left to get the bounds of buckets [0, b]
+        for (int b = 0; b < bins; b++) {
+            left_counts[b] = counts[b];
+            left_boxes[b] = boxes[b];
+            if (b > 0) {
+                left_counts[b] += left_counts[b - 1];
+                if (left_counts[b - 1] > 0) {
+                    left_boxes[b] = counts[b] > 0 ? surrounding_box(left_boxes[b - 1], boxes[b]) : left_boxes[b - 1];
                 }
             }
-            first = false;
         }
 
-        // pick axis based on largest spread
-        int axis = 0;
-        double range = max[0] - min[0];
-        double yrange = max[1] - min[1];
-        double zrange = max[2] - min[2];
-        if (yrange > range) {
-            axis = 1;
-            range = yrange;
+        // sweep from the right, evaluating the cost of splitting after bucket b
+        int right_count = 0;
+        aabb right_box;
+        for (int b = bins - 1; b > 0; b--) {
+            if (counts[b] > 0) {
+                right_box = right_count == 0 ? boxes[b] : surrounding_box(right_box, boxes[b]);
+                right_count += counts[b];
+            }
+
+            int left_count = left_counts[b - 1];
+            if (left_count == 0 || right_count == 0) {
+                continue;
+            }
+
+            double cost = options.traversal_cost + options.leaf_cost *
+                (left_count * left_boxes[b - 1].surface_area() + right_count * right_box.surface_area()) / parent_area;
+            if (best_axis < 0 || cost < best_cost) {
+                best_axis = axis;
+                best_bin = b;
+                best_cost = cost;
+            }
         }
+    }
 
-        if (zrange > range) {
-            axis = 2;
-            range = zrange;
+    if (best_axis < 0) {
+        // every centroid is in the same spot, so there is nothing to gain from splitting
+        if (size <= options.max_leaf_size) {
+            return -1;
         }
+        return start + size / 2;
+    }
 
-        auto median_split = (max[axis] + min[axis]) / 2;
-        vector<objs*> left_split;
-        vector<objs*> right_split;
-        // cerr << "median: " << median_split << "\n";
-        for (int o = 0; o < objs_list.size(); o++) {
-            double curr = objs_list[o]->bounding_box().centroid()[axis];
-            // cerr << "curr: " << curr << "\n";
-            if (curr >= median_split) {
-                right_split.push_back(objs_list[o]);
-            } else {
-                left_split.push_back(objs_list[o]);
+    double leaf_cost = options.leaf_cost * size;
+    if (size <= options.max_leaf_size && leaf_cost <= best_cost) {
+        return -1;
+    }
+
+    double range = max[best_axis] - min[best_axis];
+    auto mid = std::partition(objs_list.begin() + start, objs_list.begin() + end, [&](const bvh_primitive& o) {
+        double curr = o.box.centroid()[best_axis];
+        return std::min((int) (bins * (curr - min[best_axis]) / range), bins - 1) < best_bin;
+    });
+    return mid - objs_list.begin();
+}
+
+/**
+ * @return true if the object is a bvh_node that has two separate children
+ */
+inline bool is_interior(const objs* o) {
+    const bvh_node* tree = dynamic_cast<const bvh_node*>(o);
+    return tree != NULL && !tree->is_leaf() && tree->left != tree->right;
+}
+
+/** the most leaves a treelet can have, which bounds the 2^n subsets the optimizer looks at */
+const int max_treelet_leaves = 8;
+
+/**
+ * Recursively rebuilds the part of a treelet covering the given subset of its leaves
+ * @param set: the bit mask of leaves below this node
+ * @param node: the node to reuse, or NULL to take the next unused one from internal
+ * @param leaves, internal: the leaves and internal nodes of the treelet
+ * @param next: the index of the next unused internal node
+ * @param boxes, best: the bounding box and best partition of every subset
+ * @return the root of the rebuilt subtree
+ */
+inline objs* rewire_treelet(int set, bvh_node* node, objs** leaves, bvh_node** internal, int& next,
+                            const aabb* boxes, const int* best) {
+    if ((set & (set - 1)) == 0) {
+        return leaves[__builtin_ctz(set)];
+    }
+    if (node == NULL) {
+        node = internal[next++];
+    }
+    node->left = rewire_treelet(best[set], NULL, leaves, internal, next, boxes, best);
+    node->right = rewire_treelet(set ^ best[set], NULL, leaves, internal, next, boxes, best);
+    node->bbox = boxes[set];
+    return node;
+}
+
+/**
+ * Finds the topology of the treelet below root with the lowest SAH cost and rewires the treelet to match.
+ * The treelet is formed by opening the child with the largest surface area until it has `size` leaves.
+ * Every possible binary tree over those leaves is evaluated with dynamic programming over subsets,
+ * reusing the treelet's own internal nodes, so the subtrees below the leaves are left untouched.
+ * @param root: the root of the treelet
+ * @param size: the number of leaves to form the treelet with
+ * @param traversal_cost: the cost of visiting a node, which scales the surface area of each internal node
+ */
+inline void restructure_treelet(bvh_node* root, int size, double traversal_cost) {
+    objs* leaves[max_treelet_leaves];
+    bvh_node* internal[max_treelet_leaves];
+    int leaf_count = 2;
+    int internal_count = 1;
+    leaves[0] = root->left;
+    leaves[1] = root->right;
+    internal[0] = root;
+
+    size = std::min(size, max_treelet_leaves);
+    while (leaf_count < size) {
+        int largest = -1;
+        double largest_area = 0;
+        for (int l = 0; l < leaf_count; l++) {
+            double area = leaves[l]->bounding_box().surface_area();
+            if (is_interior(leaves[l]) && (largest < 0 || area > largest_area)) {
+                largest = l;
+                largest_area = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        bvh_node* opened = (bvh_node*) leaves[largest];
+        internal[internal_count++] = opened;
+        leaves[largest] = opened->left;
+        leaves[leaf_count++] = opened->right;
+    }
+
+    if (leaf_count < 3) {
+        return;
+    }
+
+    // the box, cost and best partition of every subset of the leaves
+    int subsets = 1 << leaf_count;
+    aabb boxes[1 << max_treelet_leaves];
+    double cost[1 << max_treelet_leaves];
+    int best[1 << max_treelet_leaves];
+    for (int set = 1; set < subsets; set++) {
+        int lowest = set & -set;
+        int rest = set ^ lowest;
+        aabb leaf_box = leaves[__builtin_ctz(lowest)]->bounding_box();
+        boxes[set] = rest == 0 ? leaf_box : surrounding_box(boxes[rest], leaf_box);
+        if (rest == 0) {
+            cost[set] = 0;
+            continue;
+        }
+
+        // only partitions where the left side holds the lowest leaf, so each one is looked at once
+        cost[set] = -1;
+        for (int part = (set - 1) & set; part > 0; part = (part - 1) & set) {
+            if ((part & lowest) == 0) {
+                continue;
             }
+            double c = cost[part] + cost[set ^ part];
+            if (cost[set] < 0 || c < cost[set]) {
+                cost[set] = c;
+                best[set] = part;
+            }
+        }
+        cost[set] += traversal_cost * boxes[set].surface_area();
+    }
+
+    // rewire the internal nodes, handing them out in the order the subsets are visited
+    int next = 1;
+    rewire_treelet(subsets - 1, root, leaves, internal, next, boxes, best);
+}
+
+/**
+ * Restructures every treelet in the tree, bottom up so each treelet is optimized after the subtrees below it
+ * @param node: the root of the subtree to optimize
+ * @param options: the treelet size and traversal cost
+ * @param parallel_depth: how many more levels may optimize their left subtree on a new thread
+ */
+inline void optimize_treelets(bvh_node* node, const bvh_options& options, int parallel_depth) {
+    if (!is_interior(node)) {
+        return;
+    }
+
+    bvh_node* left_tree = is_interior(node->left) ? (bvh_node*) node->left : NULL;
+    bvh_node* right_tree = is_interior(node->right) ? (bvh_node*) node->right : NULL;
+    if (left_tree != NULL && right_tree != NULL && parallel_depth > 0) {
+        std::thread worker([&]() {
+            optimize_treelets(left_tree, options, parallel_depth - 1);
+        });
+        optimize_treelets(right_tree, options, parallel_depth - 1);
+        worker.join();
+    } else {
+        if (left_tree != NULL) {
+            optimize_treelets(left_tree, options, parallel_depth - 1);
+        }
+        if (right_tree != NULL) {
+            optimize_treelets(right_tree, options, parallel_depth - 1);
         }
-        // cerr << "left size: " << left_split.size() << " right size: " << right_split.size() << "\n";
-        if (left_split.size() == 1) {
-            left = left_split[0];
+    }
+    restructure_treelet(node, options.treelet_size, options.traversal_cost);
+}
+
+/**
+ * BVH node constructor
+ * Copies the objects and their bounding boxes once and then partitions that list in place while building the subtrees.
+ * The subtrees near the root are built in parallel on options.threads threads.
+ * The LBVH builder instead sorts the objects by Morton code and emits the whole tree at once.
+ * @param objects: the list of objects to separate into subtrees
+ * @param options: which split method to use, the settings for the SAH builder and the thread count
+ */
+bvh_node::bvh_node(const vector<objs*>& objects, const bvh_options& options) : left(NULL), right(NULL) {
+    vector<bvh_primitive> objs_list(objects.size());
+    for (int o = 0; o < (int) objects.size(); o++) {
+        objs_list[o].object = objects[o];
+        objs_list[o].box = objects[o]->bounding_box();
+    }
+
+    int threads = thread_count(options.threads);
+
+    // every level of parallel recursion doubles the number of tasks, and one extra level helps balance
+    int parallel_depth = threads > 1 ? (int) ceil(log2(threads)) + 1 : 0;
+    if (options.method == LBVH) {
+        build_lbvh(objs_list, options, threads);
+    } else {
+        build(objs_list, 0, objs_list.size(), options, parallel_depth);
+    }
+
+    if (options.optimize_treelets) {
+        optimize_treelets(this, options, parallel_depth);
+    }
+}
+
+/**
+ * Recursively creates sub trees for both left and right sides of objs_list[start, end).
+ * Uses either the midpoint method or the surface area heuristic to partition.
+ * @param objs_list: the shared list of objects and their boxes, which is reordered in place
+ * @param start, end: the range of objects that belong to this node
+ * @param options: which split method to use and the settings for the SAH builder
+ * @param parallel_depth: how many more levels may build their left subtree on a new thread
+ */
+void bvh_node::build(vector<bvh_primitive>& objs_list, int start, int end, const bvh_options& options, int parallel_depth) {
+    int size = end - start;
+    if (size == 0) {
+        return;
+    }
+    if (size == 1) {
+        left = right = objs_list[start].object;
+    } else if (size == 2) {
+        right = objs_list[start].object;
+        left = objs_list[start + 1].object;
+    } else {
+        int mid;
+        if (options.method == SAH) {
+            bbox = objs_list[start].box;
+            for (int o = start + 1; o < end; o++) {
+                bbox = surrounding_box(bbox, objs_list[o].box);
+            }
+
+            mid = sah_split(objs_list, start, end, bbox, options);
+            if (mid < 0) {
+                for (int o = start; o < end; o++) {
+                    primitives.push_back(objs_list[o].object);
+                }
+                return;
+            }
         } else {
-            left = new bvh_node(left_split);
+            mid = midpoint_split(objs_list, start, end);
         }
 
-        if (right_split.size() == 1) {
-            right = right_split[0];
+        bvh_node* left_tree = NULL;
+        bvh_node* right_tree = NULL;
+        if (mid - start == 1) {
+            left = objs_list[start].object;
         } else {
-            right = new bvh_node(right_split);
+            left = left_tree = new bvh_node();
+        }
+
+        if (end - mid == 1) {
+            right = objs_list[mid].object;
+        } else {
+            right = right_tree = new bvh_node();
+        }
+
+        if (left_tree != NULL && right_tree != NULL && parallel_depth > 0 && size >= parallel_build_threshold) {
+            // the two ranges do not overlap, so both halves can be partitioned at the same time
+            std::thread worker([&]() {
+                left_tree->build(objs_list, start, mid, options, parallel_depth - 1);
+            });
+            right_tree->build(objs_list, mid, end, options, parallel_depth - 1);
+            worker.join();
+        } else {
+            if (left_tree != NULL) {
+                left_tree->build(objs_list, start, mid, options, parallel_depth - 1);
+            }
+            if (right_tree != NULL) {
+                right_tree->build(objs_list, mid, end, options, parallel_depth - 1);
+            }
         }
     }
 
@@ -171,4 +568,125 @@ bvh_node::bvh_node(const vector<objs*>& objects) {
     bbox = surrounding_box(box_left, box_right);
 }
 
+/**
+ * Linear BVH builder. Sorts the objects by the Morton code of their centroids and emits the
+ * binary radix tree over the sorted codes, then computes the bounding boxes bottom up.
+ * Subtrees of up to max_leaf_size objects are then collapsed into leaves where the surface area
+ * heuristic says a leaf is no more expensive than the subtree.
+ * Every step runs in parallel over the objects, so the build is close to a parallel sort.
+ * @param objs_list: the objects and their boxes
+ * @param options: the number of Morton code bits to use, and the leaf settings of the SAH builder
+ * @param threads: the number of threads to build with
+ */
+void bvh_node::build_lbvh(vector<bvh_primitive>& objs_list, const bvh_options& options, int threads) {
+    int n = objs_list.size();
+    if (n < 3) {
+        build(objs_list, 0, n, options, 0);
+        return;
+    }
+
+    double min[3];
+    double max[3];
+    centroid_bounds(objs_list, 0, n, min, max);
+
+    // quantize the centroids within the centroid bounds
+    int bits = options.morton_bits > 30 ? 63 : 30;
+    vector<morton_primitive> sorted(n);
+    parallel_for(0, n, threads, [&](int first, int last, int) {
+        for (int o = first; o < last; o++) {
+            point3 centroid = objs_list[o].box.centroid();
+            point3 p;
+            for (int i = 0; i < 3; i++) {
+                p[i] = max[i] > min[i] ? (centroid[i] - min[i]) / (max[i] - min[i]) : 0.0;
+            }
+            sorted[o].code = morton_code(p, bits);
+            sorted[o].index = o;
+        }
+    });
+    radix_sort(sorted, bits, threads);
+
+    vector<lbvh_split> internal;
+    vector<int> parents;
+    emit_radix_tree(sorted, internal, parents, threads);
+
+    // internal node 0 is the root, which is this node. The rest are allocated in a single block
+    bvh_node* block = new bvh_node[n - 1];
+    auto node_at = [&](int i) {
+        return i == 0 ? this : &block[i];
+    };
+    auto object_at = [&](int leaf) {
+        return objs_list[sorted[leaf].index].object;
+    };
+    parallel_for(0, n - 1, threads, [&](int first, int last, int) {
+        for (int i = first; i < last; i++) {
+            bvh_node* node = node_at(i);
+            node->left = internal[i].left_is_leaf ? object_at(internal[i].left) : node_at(internal[i].left);
+            node->right = internal[i].right_is_leaf ? object_at(internal[i].right) : node_at(internal[i].right);
+        }
+    });
+
+    // walk up from every leaf. The first child to reach a node stops, the second one computes its box,
+    // the range of sorted objects below it, and the cheaper of the subtree and a single leaf
+    vector<std::atomic<int>> arrivals(n - 1);
+    vector<int> range_start(n - 1);
+    vector<int> range_size(n - 1);
+    vector<double> costs(n - 1);
+    vector<char> collapse(n - 1);
+    auto child_box = [&](int child, bool is_leaf) {
+        return is_leaf ? objs_list[sorted[child].index].box : node_at(child)->bbox;
+    };
+    auto child_cost = [&](int child, bool is_leaf) {
+        return is_leaf ? options.leaf_cost : costs[child];
+    };
+    parallel_for(0, n, threads, [&](int first, int last, int) {
+        for (int leaf = first; leaf < last; leaf++) {
+            int p = parents[n - 1 + leaf];
+            while (p >= 0 && arrivals[p].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                const lbvh_split& split = internal[p];
+                aabb left_box = child_box(split.left, split.left_is_leaf);
+                aabb right_box = child_box(split.right, split.right_is_leaf);
+                node_at(p)->bbox = surrounding_box(left_box, right_box);
+
+                range_start[p] = split.left_is_leaf ? split.left : range_start[split.left];
+                range_size[p] = (split.left_is_leaf ? 1 : range_size[split.left])
+                              + (split.right_is_leaf ? 1 : range_size[split.right]);
+
+                double area = node_at(p)->bbox.surface_area();
+                double left_cost = child_cost(split.left, split.left_is_leaf);
+                double right_cost = child_cost(split.right, split.right_is_leaf);
+                double subtree_cost = options.traversal_cost + (area > 0
+                    ? (left_box.surface_area() * left_cost + right_box.surface_area() * right_cost) / area
+                    : left_cost + right_cost);
+                double leaf_cost = options.leaf_cost * range_size[p];
+                collapse[p] = range_size[p] <= options.max_leaf_size && leaf_cost <= subtree_cost;
+                costs[p] = collapse[p] ? leaf_cost : subtree_cost;
+                p = parents[p];
+            }
+        }
+    });
+
+    // only the topmost collapsed node of a subtree becomes a leaf, the nodes below it are never reached.
+    // Its ancestors up to max_leaf_size objects are the only ones that could also have been collapsed
+    parallel_for(0, n - 1, threads, [&](int first, int last, int) {
+        for (int i = first; i < last; i++) {
+            if (!collapse[i]) {
+                continue;
+            }
+            int ancestor = parents[i];
+            while (ancestor >= 0 && range_size[ancestor] <= options.max_leaf_size && !collapse[ancestor]) {
+                ancestor = parents[ancestor];
+            }
+            if (ancestor >= 0 && collapse[ancestor]) {
+                continue;
+            }
+
+            bvh_node* node = node_at(i);
+            node->left = node->right = NULL;
+            for (int leaf = range_start[i]; leaf < range_start[i] + range_size[i]; leaf++) {
+                node->primitives.push_back(object_at(leaf));
+            }
+        }
+    });
+}
+
 #endif
\ No newline at end of file
@@ -12,10 +12,12 @@
 #include "triangle.h"
 #include "aabb.h"
 #include "bvh_node.h"
+#include "timer.h"
 
 #include <iostream>
 #include <vector>
 #include <ctime>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
 
@@ -57,6 +59,8 @@ const int NUM_OBJECTS = 1000000;
 const double sphere_radius = 0.001;
 vector<objs*> objects;
 bvh_node root;
+bvh_options build_options;
+string trace_file = "";
 
 // Lighting and Shading
 const vec3 lightPosition = vec3(0, 0, 1);
@@ -197,6 +201,15 @@ color shoot_multiple_rays(int i, int j) {
     return get_average_color(colors);
 }
 
+/**
+ * Builds the BVH tree over the given objects, stores it in root, and records how long the build took
+ * @param list: the objects to build the tree for
+ */
+void build_tree(const vector<objs*>& list) {
+    scoped_timer timer("bvh build");
+    root = bvh_node(list, build_options);
+}
+
 /**
  * Add the spheres, triangle, and plane into a list of objs
  */
@@ -208,7 +221,7 @@ void add_objects() {
         objects.push_back(randsphere);
     }
     cerr << "created object list\n";
-    root = bvh_node(objects);
+    build_tree(objects);
 }
 
 /**
@@ -216,59 +229,103 @@ void add_objects() {
  */
 void create_mesh() {
     color obj_color = color(1,0,0);
+    timer_clock::time_point load_start = timer_clock::now();
     mesh obj = mesh("objs/dragon.obj", obj_color);
+    global_profiler().record("mesh load", load_start, timer_clock::now(), timer_depth());
     vector<objs*> mesh = obj.get_faces();
-    root = bvh_node(mesh);
+    build_tree(mesh);
 }
 
 /**
- * Checks command line arguments for "p" and "j" to set perspective projection and jittering respectively
+ * Checks command line arguments for "p" and "j" to set perspective projection and jittering respectively.
+ * "sah" builds the BVH with the surface area heuristic instead of the midpoint split, 
+ * and "bins=N" and "leafcost=X" configure the SAH builder.
+ * "lbvh" builds the tree from Morton codes instead, with "morton=63" for 63 bit codes, and collapses small subtrees
+ * into leaves by the same "leafcost=X" as the SAH builder,
+ * and "treelets" optimizes the finished tree's topology. "threads=N" sets the number of threads used to build the tree.
+ * "trace=FILE" writes the timings of every phase as a Chrome trace event json, next to the summary table printed at the end.
  */
 void set_command_line_args(int argc, char* argv[]) {
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
-            if (!string(argv[i]).compare("p")) {
+            string arg = string(argv[i]);
+            if (!arg.compare("p")) {
                 perspective = true;
             }
 
-            if (!string(argv[i]).compare("j")) {
+            if (!arg.compare("j")) {
                 jittering = true;
             }
+
+            if (!arg.compare("sah")) {
+                build_options.method = SAH;
+            }
+
+            if (!arg.compare("lbvh")) {
+                build_options.method = LBVH;
+            }
+
+            if (!arg.compare(0, 7, "morton=")) {
+                build_options.morton_bits = atoi(arg.c_str() + 7);
+            }
+
+            if (!arg.compare("treelets")) {
+                build_options.optimize_treelets = true;
+            }
+
+            if (!arg.compare(0, 5, "bins=")) {
+                build_options.bins = atoi(arg.c_str() + 5);
+            }
+
+            if (!arg.compare(0, 9, "leafcost=")) {
+                build_options.leaf_cost = atof(arg.c_str() + 9);
+            }
+
+            if (!arg.compare(0, 8, "threads=")) {
+                build_options.threads = atoi(arg.c_str() + 8);
+            }
+
+            if (!arg.compare(0, 6, "trace=")) {
+                trace_file = arg.substr(6);
+            }
         }
     }
 }
 
 // Creates the objects and renders the scene with/without jittering in either perspective or orthographic
 int main(int argc, char* argv[]) {
-    std::clock_t start;
-    double duration;
-    start = std::clock();
+    // the profiler measures every phase from the start of the run
+    profiler& timings = global_profiler();
 
     srand(time(NULL));
     set_command_line_args(argc, argv);
 
     // add_objects(); // for spheres
     create_mesh();
-    duration = (std::clock() - start) / (double) CLOCKS_PER_SEC;
-    cerr << "\nduration to construct tree is: " << duration << "\n";
-
-    cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    for (int j = image_height - 1; j >=0; j--) {
-        cerr << "\rScanlines done: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            if (jittering) {
-                color average = shoot_multiple_rays(i, j);
-                write_color(cout, average);
-            } else {
-                vec3 pixel_center = get_pixel_center(i, j);
-                color pixel_color = shoot_one_ray(pixel_center);
-                write_color(cout, pixel_color);
+
+    // pixels are written as they are rendered, so the render time includes the output
+    {
+        scoped_timer timer("render and output");
+        cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        for (int j = image_height - 1; j >=0; j--) {
+            cerr << "\rScanlines done: " << j << ' ' << std::flush;
+            for (int i = 0; i < image_width; ++i) {
+                if (jittering) {
+                    color average = shoot_multiple_rays(i, j);
+                    write_color(cout, average);
+                } else {
+                    vec3 pixel_center = get_pixel_center(i, j);
+                    color pixel_color = shoot_one_ray(pixel_center);
+                    write_color(cout, pixel_color);
+                }
             }
         }
     }
 
-    duration = (std::clock() - start) / (double) CLOCKS_PER_SEC;
-    cerr << "\nduration with " << NUM_OBJECTS << " objects is: " << duration << "\n";
+    timings.print_summary(cerr);
+    if (!trace_file.empty() && !timings.write_trace(trace_file)) {
+        cerr << "could not write " << trace_file << "\n";
+    }
 
     cerr << "\nDone.\n";
 }
\ No newline at end of file
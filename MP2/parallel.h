@@ -0,0 +1,49 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Resolves a requested thread count, where anything below 1 means every core
+ * @param threads: the requested number of threads
+ * @return the number of threads to actually use
+ */
+inline int thread_count(int threads) {
+    if (threads > 0) {
+        return threads;
+    }
+    return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+/**
+ * Splits [begin, end) into one contiguous chunk per thread and calls func(chunk_start, chunk_end, thread_index)
+ * for every chunk in parallel. The calling thread runs the first chunk itself.
+ * @param begin, end: the range of indices to process
+ * @param threads: the number of threads to spread the range over, 0 for every core
+ * @param func: the work to do for each chunk
+ */
+template <typename F>
+inline void parallel_for(int begin, int end, int threads, F func) {
+    int count = end - begin;
+    threads = std::min(thread_count(threads), std::max(count, 1));
+    if (threads <= 1) {
+        func(begin, end, 0);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    int chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        int chunk_start = std::min(begin + t * chunk, end);
+        int chunk_end = std::min(chunk_start + chunk, end);
+        workers.push_back(std::thread(func, chunk_start, chunk_end, t));
+    }
+    func(begin, std::min(begin + chunk, end), 0);
+    for (int t = 0; t < (int) workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+#endif
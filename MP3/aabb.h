@@ -3,6 +3,9 @@
 
 #include "vec3.h"
 #include "ray.h"
+#include "stats.h"
+#include <cmath>
+#include <limits>
 
 class aabb {
     public:
@@ -30,6 +33,7 @@ class aabb {
         
         virtual bool ray_intersection(const ray& r, double tmin, double tmax) const;
         point3 calculate_centroid() const;
+        double surface_area() const;
 
     public:
         point3 minimum;
@@ -43,6 +47,7 @@ class aabb {
  * @return true or false depending on if it intersects
  **/
 bool aabb::ray_intersection(const ray& r, double tmin, double tmax) const {
+    COUNT_RAY_STAT(box_tests, 1);
     for (int i = 0; i < 3; i++) {
         double a = (minimum[i] - r.origin()[i]) / r.direction()[i];
         double b = (maximum[i] - r.origin()[i]) / r.direction()[i];
@@ -57,6 +62,23 @@ bool aabb::ray_intersection(const ray& r, double tmin, double tmax) const {
 
 }
 
+/**
+ * @return the largest float strictly below v, so a box stored in float never shrinks,
+ * and a flat box keeps at least one float of thickness
+ */
+inline float float_below(double v) {
+    float f = (float) v;
+    return f >= v ? nextafterf(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+/**
+ * @return the smallest float strictly above v
+ */
+inline float float_above(double v) {
+    float f = (float) v;
+    return f <= v ? nextafterf(f, std::numeric_limits<float>::infinity()) : f;
+}
+
 /**
  * Creates a surrounding bounding box, given two smaller bounding boxes
  * It uses the overall max and overall min point of both boxes.
@@ -84,6 +106,15 @@ point3 aabb::calculate_centroid() const {
     return point3(x, y, z);
 }
 
+/**
+ * Calculates the surface area of the bounding box, used by the SAH builder
+ * @return the total area of all six faces
+ **/
+double aabb::surface_area() const {
+    vec3 extent = maximum - minimum;
+    return 2.0 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+}
+
 inline ostream& operator<<(ostream &out, const aabb& bbox) {
     return out << "min: (" << bbox.min() << ") max: (" << bbox.max() << ")";
 }
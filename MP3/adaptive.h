@@ -0,0 +1,57 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "vec3.h"
+#include "color.h"
+#include <cmath>
+#include <limits>
+
+/** the brightness below which an error is measured against this floor instead, so dark pixels do not need endless samples */
+const double adaptive_brightness_floor = 0.05;
+
+/**
+ * The running mean of a pixel's samples and the variance of their brightness, updated with Welford's method
+ * so neither needs the samples to be kept
+ */
+struct pixel_estimate {
+    int count = 0;
+    color sum = color(0, 0, 0);
+    double brightness_mean = 0;
+    double brightness_m2 = 0;
+
+    void add(const color& sample);
+    double relative_error() const;
+
+    /** @return the average of the samples so far */
+    color mean() const {
+        return count > 0 ? sum / count : sum;
+    }
+};
+
+/**
+ * Adds a sample. Its brightness is clamped to what the image can show, so a
+ * pixel that is saturated anyway does not keep asking for samples.
+ */
+inline void pixel_estimate::add(const color& sample) {
+    count++;
+    sum += sample;
+    double brightness = fmin(fmax(luminance(sample), 0.0), 1.0);
+    double delta = brightness - brightness_mean;
+    brightness_mean += delta / count;
+    brightness_m2 += delta * (brightness - brightness_mean);
+}
+
+/**
+ * The standard error of the pixel's mean brightness relative to the brightness itself,
+ * which is how far off the pixel is likely still to be
+ * @return the relative error, or infinity with fewer than two samples
+ */
+inline double pixel_estimate::relative_error() const {
+    if (count < 2) {
+        return std::numeric_limits<double>::infinity();
+    }
+    double variance = brightness_m2 / (count - 1);
+    return sqrt(variance / count) / fmax(brightness_mean, adaptive_brightness_floor);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,510 @@
+// Kernel counters would be measured along with the kernels, so the benchmark is always built without them
+#ifndef NO_RAY_STATS
+#define NO_RAY_STATS
+#endif
+
+#include "vec3.h"
+#include "ray.h"
+#include "utils.h"
+#include "rng.h"
+#include "mesh.h"
+#include "material.h"
+
+#include "objs.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "rectangle.h"
+#include "aabb.h"
+#include "bvh_node.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "framebuffer.h"
+#include "parallel.h"
+#include "timer.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <limits>
+
+using std::cout;
+using std::cerr;
+using std::string;
+using std::vector;
+using std::numeric_limits;
+
+
+// --------------------------------------- VARIABLES --------------------------------------- //
+static bool quick = false;
+static string objs_directory = "../MP2/objs";
+static string output_file = "";
+static string label = "";
+static int threads = 0;
+static int max_spheres = 1000000;
+
+// the kernels are timed over kernel_rays rays against kernel_primitives primitives, repeated for at least kernel_seconds
+const int kernel_rays = 4096;
+const int kernel_primitives = 256;
+const double kernel_seconds = 0.25;
+
+// every scene is rendered at frame_size x frame_size with primary rays, repeated for at least frame_seconds
+const int frame_size = 512;
+const double frame_seconds = 0.25;
+
+const char* mesh_names[4] = { "cow", "teapot", "bunny", "dragon" };
+
+/** one benchmarked build of one scene */
+struct build_result {
+    string scene;
+    string builder;
+    int primitives;
+    double load_seconds;
+    double build_seconds;
+    double flatten_seconds;
+    long long tree_nodes;
+    long long tree_bytes;
+    long long linear_bytes;
+    long long rss_delta_bytes;
+    double frame_mrays;
+    double frame_hit_rate;
+};
+
+/** one benchmarked intersection kernel */
+struct kernel_result {
+    string name;
+    long long tests;
+    double ns_per_test;
+    double hit_rate;
+};
+
+// --------------------------------------- FUNCTIONS --------------------------------------- //
+
+/**
+ * @return the seconds since start
+ */
+double seconds_since(timer_clock::time_point start) {
+    return std::chrono::duration<double>(timer_clock::now() - start).count();
+}
+
+/**
+ * @return the resident memory of the process in bytes, or 0 where /proc is not available
+ */
+long long resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    long long pages = 0;
+    long long resident = 0;
+    if (!(statm >> pages >> resident)) {
+        return 0;
+    }
+    return resident * 4096;
+}
+
+/**
+ * Creates random rays that start outside the unit cube and point at a random spot inside it, so most rays pass
+ * near the benchmarked primitives and a fair share hit them
+ */
+vector<ray> kernel_ray_set(pcg32& rng) {
+    vector<ray> rays(kernel_rays);
+    for (int k = 0; k < kernel_rays; k++) {
+        point3 origin = 2 * unit_vector(random_vec3(rng, -1, 1)) + vec3(0.5, 0.5, 0.5);
+        point3 target = random_vec3(rng, 0, 1);
+        rays[k] = ray(origin, target - origin);
+    }
+    return rays;
+}
+
+/**
+ * Times an intersection kernel by testing every ray against every primitive, repeating until kernel_seconds have passed
+ * @param test: returns true if ray r hits primitive p
+ */
+template <typename F>
+kernel_result time_kernel(const string& name, const vector<ray>& rays, int primitives, F test) {
+    long long tests = 0;
+    long long hits = 0;
+    timer_clock::time_point start = timer_clock::now();
+    do {
+        for (int r = 0; r < (int) rays.size(); r++) {
+            for (int p = 0; p < primitives; p++) {
+                hits += test(rays[r], p);
+            }
+        }
+        tests += (long long) rays.size() * primitives;
+    } while (seconds_since(start) < kernel_seconds);
+    double seconds = seconds_since(start);
+
+    kernel_result result;
+    result.name = name;
+    result.tests = tests;
+    result.ns_per_test = 1e9 * seconds / tests;
+    result.hit_rate = (double) hits / tests;
+    cerr << name << ": " << result.ns_per_test << " ns/test\n";
+    return result;
+}
+
+/**
+ * Benchmarks triangle::ray_intersection, sphere::ray_intersection and aabb::ray_intersection
+ * on small random primitives inside the unit cube
+ */
+vector<kernel_result> run_kernels() {
+    pcg32 rng = pcg32(1, 1);
+    vector<ray> rays = kernel_ray_set(rng);
+    material* m = new lambertian();
+
+    vector<triangle> triangles;
+    vector<sphere> spheres;
+    vector<aabb> boxes;
+    for (int p = 0; p < kernel_primitives; p++) {
+        point3 center = random_vec3(rng, 0, 1);
+        triangles.push_back(triangle(center + random_vec3(rng, -0.2, 0.2), center + random_vec3(rng, -0.2, 0.2),
+                                     center + random_vec3(rng, -0.2, 0.2), color(1, 1, 1), m));
+        spheres.push_back(sphere(center, random_double(rng, 0.02, 0.1), color(1, 1, 1), m));
+        vec3 half = random_vec3(rng, 0.02, 0.1);
+        boxes.push_back(aabb(center - half, center + half));
+    }
+
+    vector<kernel_result> results;
+    results.push_back(time_kernel("triangle::ray_intersection", rays, kernel_primitives, [&](const ray& r, int p) {
+        hit_record rec;
+        return triangles[p].ray_intersection(r, rec, 0.001, numeric_limits<double>::infinity());
+    }));
+    results.push_back(time_kernel("sphere::ray_intersection", rays, kernel_primitives, [&](const ray& r, int p) {
+        hit_record rec;
+        return spheres[p].ray_intersection(r, rec, 0.001, numeric_limits<double>::infinity());
+    }));
+    results.push_back(time_kernel("aabb::ray_intersection", rays, kernel_primitives, [&](const ray& r, int p) {
+        return boxes[p].ray_intersection(r, 0.001, numeric_limits<double>::infinity());
+    }));
+    return results;
+}
+
+/**
+ * Creates count spheres at random spots in a cube that grows with the count, so the density stays the same
+ */
+vector<objs*> sphere_field(int count) {
+    pcg32 rng = pcg32(count, 2);
+    double side = cbrt((double) count);
+    material* m = new lambertian();
+    vector<objs*> field(count);
+    for (int k = 0; k < count; k++) {
+        field[k] = new sphere(random_vec3(rng, 0, side), 0.3, color(1, 1, 1), m);
+    }
+    return field;
+}
+
+/**
+ * Counts the nodes of a tree and the bytes they and their leaf lists take up
+ * @param bytes: increased by the size of every node and leaf list
+ * @return the number of nodes
+ */
+long long count_tree(const objs* node, long long& bytes) {
+    const bvh_node* tree = dynamic_cast<const bvh_node*>(node);
+    if (tree == NULL) {
+        return 0;
+    }
+    bytes += sizeof(bvh_node) + tree->primitives.capacity() * sizeof(objs*);
+    long long count = 1 + count_tree(tree->left, bytes);
+    if (tree->right != tree->left) {
+        count += count_tree(tree->right, bytes);
+    }
+    return count;
+}
+
+/**
+ * Shoots one primary ray per pixel of a frame_size x frame_size image at the scene from in front of it,
+ * repeating until frame_seconds have passed
+ * @param hit_rate: set to the share of rays that hit something
+ * @return the millions of rays traced per second
+ */
+double frame_mrays(const linear_bvh& world, double& hit_rate) {
+    aabb box = world.bounding_box();
+    point3 center = (box.min() + box.max()) / 2;
+    vec3 extent = box.max() - box.min();
+    double size = fmax(extent.x(), fmax(extent.y(), extent.z()));
+    point3 eye = center + vec3(0, 0, extent.z() / 2 + 1.2 * size);
+
+    vector<tile> tiles = make_tiles(frame_size, frame_size, 32);
+    long long rays = 0;
+    std::atomic<long long> hits(0);
+    timer_clock::time_point start = timer_clock::now();
+    do {
+        work_stealing_for(tiles.size(), threads, [&](int t, int thread) {
+            const tile& area = tiles[t];
+            long long tile_hits = 0;
+            for (int j = area.y0; j < area.y1; j++) {
+                for (int i = area.x0; i < area.x1; i++) {
+                    vec3 direction = vec3((i + 0.5) / frame_size - 0.5, (j + 0.5) / frame_size - 0.5, -1);
+                    hit_record rec;
+                    tile_hits += world.closest_hit(ray(eye, direction), rec, 0.001, numeric_limits<double>::infinity());
+                }
+            }
+            hits += tile_hits;
+        });
+        rays += (long long) frame_size * frame_size;
+    } while (seconds_since(start) < frame_seconds);
+    double seconds = seconds_since(start);
+
+    hit_rate = (double) hits / rays;
+    return rays / seconds / 1e6;
+}
+
+/**
+ * Builds the tree over the scene with every builder, then measures its size and how fast it traces a frame
+ * @param scene: the name of the scene for the report
+ * @param load_seconds: how long the scene took to load or create
+ */
+void run_builds(const string& scene, const vector<objs*>& list, double load_seconds, vector<build_result>& results) {
+    const char* builders[4] = { "midpoint", "sah", "lbvh", "lbvh+treelets" };
+    for (int b = 0; b < 4; b++) {
+        bvh_options options;
+        options.threads = threads;
+        options.method = b == 0 ? MIDPOINT : b == 1 ? SAH : LBVH;
+        options.optimize_treelets = b == 3;
+
+        // the trees are never freed, since a bvh_node does not own its children, so the growth is the tree's memory
+        long long rss_before = resident_bytes();
+        timer_clock::time_point start = timer_clock::now();
+        bvh_node* root = new bvh_node(list, options);
+        double build_seconds = seconds_since(start);
+
+        start = timer_clock::now();
+        linear_bvh flat = linear_bvh(*root);
+        double flatten_seconds = seconds_since(start);
+
+        build_result result;
+        result.scene = scene;
+        result.builder = builders[b];
+        result.primitives = list.size();
+        result.load_seconds = load_seconds;
+        result.build_seconds = build_seconds;
+        result.flatten_seconds = flatten_seconds;
+        result.tree_bytes = 0;
+        result.tree_nodes = count_tree(root, result.tree_bytes);
+        result.linear_bytes = flat.nodes.size() * sizeof(linear_bvh_node) + flat.primitives.size() * sizeof(objs*);
+        result.rss_delta_bytes = resident_bytes() - rss_before;
+        result.frame_mrays = frame_mrays(flat, result.frame_hit_rate);
+        results.push_back(result);
+        cerr << scene << " " << builders[b] << ": built in " << build_seconds << " s, "
+             << result.frame_mrays << " Mrays/s\n";
+    }
+}
+
+/**
+ * Escapes the characters json does not allow inside a string
+ */
+string json_string(const string& text) {
+    string escaped = "\"";
+    for (int k = 0; k < (int) text.size(); k++) {
+        if (text[k] == '"' || text[k] == '\\') {
+            escaped += '\\';
+        }
+        escaped += text[k];
+    }
+    return escaped + "\"";
+}
+
+/**
+ * Writes the results as json, with one object per kernel and one per scene and builder
+ */
+void write_json(std::ostream& out, const vector<kernel_result>& kernels, const vector<build_result>& builds) {
+    char line[512];
+    out << "{\n";
+    out << "  \"label\": " << json_string(label) << ",\n";
+    out << "  \"time\": " << (long long) time(NULL) << ",\n";
+    out << "  \"threads\": " << thread_count(threads) << ",\n";
+    out << "  \"quick\": " << (quick ? "true" : "false") << ",\n";
+    out << "  \"kernels\": [\n";
+    for (int k = 0; k < (int) kernels.size(); k++) {
+        snprintf(line, sizeof(line), "    {\"name\": %s, \"tests\": %lld, \"ns_per_test\": %.4f, \"hit_rate\": %.4f}%s\n",
+                 json_string(kernels[k].name).c_str(), kernels[k].tests, kernels[k].ns_per_test, kernels[k].hit_rate,
+                 k + 1 < (int) kernels.size() ? "," : "");
+        out << line;
+    }
+    out << "  ],\n";
+    out << "  \"builds\": [\n";
+    for (int k = 0; k < (int) builds.size(); k++) {
+        const build_result& b = builds[k];
+        snprintf(line, sizeof(line),
+                 "    {\"scene\": %s, \"builder\": %s, \"primitives\": %d, \"load_seconds\": %.6f, \"build_seconds\": %.6f, "
+                 "\"flatten_seconds\": %.6f, \"tree_nodes\": %lld, \"tree_bytes\": %lld, \"linear_bytes\": %lld, "
+                 "\"rss_delta_bytes\": %lld, \"frame_mrays_per_second\": %.4f, \"frame_hit_rate\": %.4f}%s\n",
+                 json_string(b.scene).c_str(), json_string(b.builder).c_str(), b.primitives, b.load_seconds, b.build_seconds,
+                 b.flatten_seconds, b.tree_nodes, b.tree_bytes, b.linear_bytes, b.rss_delta_bytes, b.frame_mrays,
+                 b.frame_hit_rate, k + 1 < (int) builds.size() ? "," : "");
+        out << line;
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+/**
+ * Checks one tree against the answer of the primitive itself
+ * @param name: the name of the tree and scene, printed when it is wrong
+ * @param expected: whether the ray hits the primitive
+ * @return 1 if the tree's closest hit or occlusion test disagrees, otherwise 0
+ */
+template <typename T>
+int check_tree(const T& tree, const string& name, const ray& r, bool expected) {
+    hit_record rec;
+    bool hit = tree.ray_intersection(r, rec, 0.001, numeric_limits<double>::infinity());
+    bool occluded = tree.occluded(r, 0.001, numeric_limits<double>::infinity());
+    if (hit != expected || occluded != expected) {
+        cerr << name << ": expected " << (expected ? "a hit" : "a miss") << " but got hit " << hit
+             << " and occluded " << occluded << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Checks the trees against axis aligned quads far from the origin. The box of such a quad is flat, so it only has
+ * the thickness its float bounds are rounded out by, and a strict or rounded to nearest slab test culls it.
+ * @return the number of checks a tree got wrong
+ */
+int check_flat_quads() {
+    material* m = new lambertian();
+    const int distances[6] = { 1, 3, 5, 10, 100, 1000 };
+    const split_method methods[3] = { MIDPOINT, SAH, LBVH };
+    const char* method_names[3] = { "midpoint", "sah", "lbvh" };
+    int failures = 0;
+    for (int d = 0; d < 6; d++) {
+        for (int axis = 0; axis < 3; axis++) {
+            // the quad faces along axis, spanning [-1, 1] on the other two
+            int u = (axis + 1) % 3;
+            int v = (axis + 2) % 3;
+            auto corner = [&](double a, double b) {
+                point3 p;
+                p[axis] = -distances[d];
+                p[u] = a;
+                p[v] = b;
+                return p;
+            };
+            rectangle* quad = new rectangle(corner(-1, -1), corner(1, -1), corner(1, 1), corner(-1, 1), color(1, 1, 1), m);
+            // enough spheres off to the side that every builder gives the quad a leaf and a flat box of its own
+            vector<objs*> list;
+            list.push_back(quad);
+            for (int k = 0; k < 7; k++) {
+                list.push_back(new sphere(corner(4 + 3 * k, 4 + 2 * k), 0.5, color(1, 1, 1), m));
+            }
+
+            point3 origin = point3(0, 0, 0);
+            origin[u] = 0.3;
+            origin[v] = 0.2;
+            vec3 straight = vec3(0, 0, 0);
+            straight[axis] = -1;
+            vec3 oblique = straight;
+            oblique[u] = 0.1 / distances[d];
+            oblique[v] = 0.05 / distances[d];
+            ray rays[2] = { ray(origin, straight), ray(origin, oblique) };
+
+            for (int k = 0; k < 3; k++) {
+                bvh_options options;
+                options.method = methods[k];
+                bvh_node root = bvh_node(list, options);
+                linear_bvh flat = linear_bvh(root);
+                wide_bvh<4> wide4 = wide_bvh<4>(root);
+                wide_bvh<8> wide8 = wide_bvh<8>(root);
+                string name = string(method_names[k]) + " tree, quad at " + std::to_string(distances[d])
+                            + " along axis " + std::to_string(axis);
+                for (int r = 0; r < 2; r++) {
+                    hit_record rec;
+                    bool expected = quad->ray_intersection(rays[r], rec, 0.001, numeric_limits<double>::infinity());
+                    failures += check_tree(flat, "linear bvh " + name, rays[r], expected);
+                    failures += check_tree(wide4, "4 wide bvh " + name, rays[r], expected);
+                    failures += check_tree(wide8, "8 wide bvh " + name, rays[r], expected);
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+/**
+ * "quick" only runs the small scenes, for a fast check. "objs=DIR" is where the obj meshes are read from,
+ * "maxspheres=N" caps the largest sphere field, "threads=N" sets the threads used to build and trace,
+ * "label=NAME" tags the results, for example with the version being measured, and "out=FILE" writes the
+ * json to a file instead of stdout.
+ */
+void set_command_line_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = string(argv[i]);
+        if (!arg.compare("quick")) {
+            quick = true;
+        }
+
+        if (!arg.compare(0, 5, "objs=")) {
+            objs_directory = arg.substr(5);
+        }
+
+        if (!arg.compare(0, 11, "maxspheres=")) {
+            max_spheres = atoi(arg.c_str() + 11);
+        }
+
+        if (!arg.compare(0, 8, "threads=")) {
+            threads = atoi(arg.c_str() + 8);
+        }
+
+        if (!arg.compare(0, 6, "label=")) {
+            label = arg.substr(6);
+        }
+
+        if (!arg.compare(0, 4, "out=")) {
+            output_file = arg.substr(4);
+        }
+    }
+}
+
+// Checks the trees on flat quads, then runs the kernel, build and frame benchmarks and prints the results as json
+int main(int argc, char* argv[]) {
+    set_command_line_args(argc, argv);
+    int failures = check_flat_quads();
+    if (failures > 0) {
+        cerr << failures << " checks of the trees against flat quads failed\n";
+        return 1;
+    }
+    if (quick) {
+        max_spheres = std::min(max_spheres, 10000);
+    }
+
+    vector<kernel_result> kernels = run_kernels();
+
+    vector<build_result> builds;
+    for (int k = 0; k < 4; k++) {
+        if (quick && k >= 2) {
+            break;
+        }
+        string filename = objs_directory + "/" + mesh_names[k] + ".obj";
+        timer_clock::time_point start = timer_clock::now();
+        mesh obj = mesh(filename, color(1, 1, 1), new lambertian(), threads);
+        double load_seconds = seconds_since(start);
+        if (!obj.loaded) {
+            cerr << "skipping " << filename << ", which could not be loaded\n";
+            continue;
+        }
+        run_builds(mesh_names[k], obj.get_faces(), load_seconds, builds);
+    }
+
+    for (int count = 10; count <= max_spheres; count *= 10) {
+        timer_clock::time_point start = timer_clock::now();
+        vector<objs*> field = sphere_field(count);
+        double load_seconds = seconds_since(start);
+        run_builds("spheres_" + std::to_string(count), field, load_seconds, builds);
+    }
+
+    if (output_file.empty()) {
+        write_json(cout, kernels, builds);
+    } else {
+        std::ofstream out(output_file);
+        write_json(out, kernels, builds);
+        if (!out) {
+            cerr << "could not write " << output_file << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "vec3.h"
 #include <vector>
 #include <iostream>
+#include <algorithm>
 
 /**
  * Write the translated [0, 255] value of each color component.
@@ -39,4 +40,39 @@ color get_average_color(std::vector<color> &vect) {
     return avg / vect.size();
 }
 
+/**
+ * @return the brightness of a color as the eye sees it
+ */
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+/** the gamma of the display that tonemapped images are encoded for */
+const double display_gamma = 2.2;
+
+/**
+ * Maps an unbounded color into [0, 1] for display, with Reinhard's c / (1 + c) on each channel
+ * so highlights roll off instead of clipping, then encodes it for the display's gamma
+ * @param c the linear color, with channels in [0, infinity)
+ * @return the displayable color
+ **/
+inline color tonemap(const color& c) {
+    color mapped = vec_clamp_min(c, 0.0);
+    mapped = color(mapped.x() / (1 + mapped.x()), mapped.y() / (1 + mapped.y()), mapped.z() / (1 + mapped.z()));
+    return color(pow(mapped.x(), 1 / display_gamma), pow(mapped.y(), 1 / display_gamma), pow(mapped.z(), 1 / display_gamma));
+}
+
+/**
+ * Maps a value to a color on a blue, cyan, green, yellow, red scale, for drawing debug images
+ * @param t the value, where 0 is blue and 1 is red. Values outside [0, 1] are clamped
+ * @return the color for the value
+ **/
+color heatmap_color(double t) {
+    const color stops[5] = { color(0, 0, 1), color(0, 1, 1), color(0, 1, 0), color(1, 1, 0), color(1, 0, 0) };
+    t = fmin(fmax(t, 0.0), 1.0) * 4;
+    int stop = std::min((int) t, 3);
+    double blend = t - stop;
+    return stops[stop] * (1 - blend) + stops[stop + 1] * blend;
+}
+
 #endif
\ No newline at end of file
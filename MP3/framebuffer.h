@@ -0,0 +1,206 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "vec3.h"
+#include "color.h"
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+using std::vector;
+
+/**
+ * A rectangle of pixels [x0, x1) x [y0, y1) that is rendered as one unit of work
+ */
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+/**
+ * Splits a width x height image into square tiles, with smaller tiles along the right and top edges
+ * @param size: the width and height of a tile in pixels
+ * @return the tiles, row by row
+ */
+inline vector<tile> make_tiles(int width, int height, int size) {
+    vector<tile> tiles;
+    for (int y = 0; y < height; y += size) {
+        for (int x = 0; x < width; x += size) {
+            tiles.push_back({ x, y, std::min(x + size, width), std::min(y + size, height) });
+        }
+    }
+    return tiles;
+}
+
+/**
+ * The file formats the framebuffer can be written in: plain text ppm (P3), binary ppm (P6),
+ * and the floating point pfm that keeps colors brighter than white
+ */
+enum image_format { PPM_TEXT, PPM_BINARY, PFM };
+
+/**
+ * Reads the name of an image format
+ * @param name: "p3", "p6" or "pfm"
+ * @param format: set to the format if the name is known
+ * @return false if the name is not a known format
+ */
+inline bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "p3") {
+        format = PPM_TEXT;
+    } else if (name == "p6") {
+        format = PPM_BINARY;
+    } else if (name == "pfm") {
+        format = PFM;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The rendered image, shared by every render thread. Each pixel is written by exactly one thread,
+ * so no locking is needed. Pixel (i, j) follows the image coordinates, with j = 0 at the bottom row.
+ */
+class framebuffer {
+    public:
+        framebuffer() {}
+        framebuffer(int w, int h) : width(w), height(h), pixels(w * h) {}
+
+        color& at(int i, int j) {
+            return pixels[j * width + i];
+        }
+
+        const color& at(int i, int j) const {
+            return pixels[j * width + i];
+        }
+
+        void write(std::ostream& out, image_format format) const;
+        void write_ppm(std::ostream& out) const;
+        void write_ppm_text(std::ostream& out) const;
+        void write_pfm(std::ostream& out) const;
+        framebuffer tonemapped() const;
+
+    public:
+        int width = 0;
+        int height = 0;
+        vector<color> pixels;
+};
+
+/**
+ * Writes the image in the given format
+ * @param out: the stream to write to, which should be opened in binary mode
+ */
+void framebuffer::write(std::ostream& out, image_format format) const {
+    if (format == PPM_TEXT) {
+        write_ppm_text(out);
+    } else if (format == PFM) {
+        write_pfm(out);
+    } else {
+        write_ppm(out);
+    }
+}
+
+/**
+ * Writes the image as a binary ppm, from the top row down. Colors brighter than white are clamped to it.
+ * The whole file is built in memory and written at once.
+ * @param out: the stream to write to
+ */
+void framebuffer::write_ppm(std::ostream& out) const {
+    std::string header = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    vector<unsigned char> bytes(header.size() + 3 * pixels.size());
+    memcpy(bytes.data(), header.data(), header.size());
+    unsigned char* next = bytes.data() + header.size();
+    for (int j = height - 1; j >= 0; j--) {
+        for (int i = 0; i < width; i++) {
+            color c = vec_clamp(at(i, j), 0, 1);
+            *next++ = static_cast<unsigned char>(255.999 * c.x());
+            *next++ = static_cast<unsigned char>(255.999 * c.y());
+            *next++ = static_cast<unsigned char>(255.999 * c.z());
+        }
+    }
+    out.write((const char*) bytes.data(), bytes.size());
+}
+
+/**
+ * Writes the image as 32 bit floats in a little endian pfm, which stores rows from the bottom up like the framebuffer
+ * @param out: the stream to write to
+ */
+void framebuffer::write_pfm(std::ostream& out) const {
+    std::string header = "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+    vector<unsigned char> bytes(header.size() + 3 * sizeof(float) * pixels.size());
+    memcpy(bytes.data(), header.data(), header.size());
+    // the floats start right after the header, which leaves them unaligned, so they are copied in byte by byte
+    unsigned char* next = bytes.data() + header.size();
+    for (int p = 0; p < (int) pixels.size(); p++) {
+        float values[3] = { pixels[p].x(), pixels[p].y(), pixels[p].z() };
+        memcpy(next, values, sizeof(values));
+        next += sizeof(values);
+    }
+    out.write((const char*) bytes.data(), bytes.size());
+}
+
+/**
+ * @return a copy of the image with every pixel tonemapped for display, which keeps the highlights
+ * that writing the linear colors to an 8 bit format would clip
+ */
+framebuffer framebuffer::tonemapped() const {
+    framebuffer mapped = framebuffer(width, height);
+    for (int p = 0; p < (int) pixels.size(); p++) {
+        mapped.pixels[p] = tonemap(pixels[p]);
+    }
+    return mapped;
+}
+
+/**
+ * Writes the image as a plain text ppm, from the top row down. Colors brighter than white are clamped to it.
+ * @param out: the stream to write to
+ */
+void framebuffer::write_ppm_text(std::ostream& out) const {
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (int j = height - 1; j >= 0; j--) {
+        for (int i = 0; i < width; i++) {
+            write_color(out, vec_clamp(at(i, j), 0, 1));
+        }
+    }
+}
+
+/**
+ * Running sums of the samples of every pixel, for renders that add samples over many passes.
+ * Like the framebuffer, each pixel is only ever added to by one thread at a time.
+ */
+class accumulation_buffer {
+    public:
+        accumulation_buffer() {}
+        accumulation_buffer(int w, int h) : width(w), height(h), sums(w * h, color(0, 0, 0)), samples(w * h, 0) {}
+
+        /**
+         * Adds a sample to the pixel (i, j)
+         */
+        void add(int i, int j, const color& sample) {
+            sums[j * width + i] += sample;
+            samples[j * width + i]++;
+        }
+
+        void resolve(framebuffer& image) const;
+
+    public:
+        int width = 0;
+        int height = 0;
+        vector<color> sums;
+        vector<int> samples;
+};
+
+/**
+ * Writes the average of every pixel's samples so far into the image
+ * @param image: a framebuffer of the same size
+ */
+void accumulation_buffer::resolve(framebuffer& image) const {
+    for (int p = 0; p < (int) sums.size(); p++) {
+        image.pixels[p] = samples[p] > 0 ? sums[p] / samples[p] : color(0, 0, 0);
+    }
+}
+
+#endif
\ No newline at end of file
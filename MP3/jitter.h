@@ -3,71 +3,119 @@
 
 #include "color.h"
 #include <cstdlib>
-#include <random>
-#include <map>
+#include <vector>
 #include <iostream>
+#include <algorithm>
 #include "utils.h"
 
-using std::map;
-using std::pair;
+using std::vector;
 using std::cout;
 using std::cerr;
 
 /**
- * Creates a 2D array indicating where to take samples within a pixel, using multi-jittered sampling. 
+ * Where to take a sample within a pixel, with both coordinates in [0, 1)
+ */
+struct sample_offset {
+    float x;
+    float y;
+};
+
+/**
+ * Shuffles the first count entries of values with Fisher-Yates
+ */
+inline void shuffle(int* values, int count, pcg32& rng) {
+    for (int i = count - 1; i > 0; i--) {
+        std::swap(values[i], values[rng.next_uint(i + 1)]);
+    }
+}
+
+/**
+ * Creates the sample offsets for a pixel using multi-jittered sampling. The pixel is split into a coarse grid,
+ * and each coarse cell gets one sample placed at the center of a fine grid cell, such that no two samples share
+ * a row or a column of the fine grid.
  * @param fine_grid the overall size of the grid. The coarse grid is sqrt(fine_grid) x sqrt(fine_grid)
- * @return a fine_grid x fine_grid boolean array, where True represents the position to take a sample at.
+ * @param rng the random number generator to place the samples with
+ * @return one offset per coarse cell
  **/
-inline bool** get_multi_jitter_mask(int fine_grid) {
+inline vector<sample_offset> multi_jitter_pattern(int fine_grid, pcg32& rng) {
     int coarse_size = (int) sqrt(fine_grid);
-     
-    map<int, bool> row;
-    map<int, bool> col;
+    vector<int> rows(coarse_size * coarse_size);
+    vector<int> cols(coarse_size * coarse_size);
 
-    // initialize 2D array
-    bool** sample;
-    sample = new bool*[fine_grid];
-    for (int i = 0; i < fine_grid; i++) {
-        sample[i] = new bool[fine_grid];
-        for (int j = 0; j < fine_grid; j++) {
-            sample[i][j] = false;
+    // within each coarse row every sample takes a different fine row, and likewise for the columns
+    for (int i = 0; i < coarse_size; i++) {
+        for (int k = 0; k < coarse_size; k++) {
+            rows[i * coarse_size + k] = k;
+            cols[i * coarse_size + k] = k;
         }
+        shuffle(&rows[i * coarse_size], coarse_size, rng);
+        shuffle(&cols[i * coarse_size], coarse_size, rng);
     }
 
-    // for each coarse grid cell, choose a sample and make sure the row and col are unique
+    vector<sample_offset> samples(coarse_size * coarse_size);
     for (int i = 0; i < coarse_size; i++) {
         for (int j = 0; j < coarse_size; j++) {
-            int x;
-            int y;
-            do {
-                x = random_int(0, coarse_size) + (i * coarse_size);
-            } while (row.count(x) > 0);
-            row.insert(pair<int,bool>(x,true));
-            
-            do {
-                y = random_int(0, coarse_size) + (j * coarse_size);
-            } while (col.count(y) > 0);
-            col.insert(pair<int,bool>(y,true));
-            
-            sample[x][y] = true;
+            int x = i * coarse_size + rows[i * coarse_size + j];
+            int y = j * coarse_size + cols[j * coarse_size + i];
+            samples[i * coarse_size + j] = { (float) ((x + 0.5) / fine_grid), (float) ((y + 0.5) / fine_grid) };
+        }
+    }
+    return samples;
+}
+
+/**
+ * A fixed set of multi-jittered patterns that is generated once and shared by every pixel,
+ * so rendering never allocates or builds a pattern per pixel
+ */
+class jitter_pattern_pool {
+    public:
+        jitter_pattern_pool() {}
+        jitter_pattern_pool(int fine_grid, int count, uint64_t seed);
+
+        /**
+         * Picks one of the patterns at random
+         * @param rng the random number generator of the pixel
+         */
+        const vector<sample_offset>& pick(pcg32& rng) const {
+            return patterns[rng.next_uint(patterns.size())];
         }
+
+    public:
+        vector<vector<sample_offset>> patterns;
+};
+
+/**
+ * Generates the pool of patterns
+ * @param fine_grid the size of the fine grid the samples are placed on
+ * @param count the number of different patterns
+ * @param seed the seed for the patterns' random numbers
+ */
+jitter_pattern_pool::jitter_pattern_pool(int fine_grid, int count, uint64_t seed) {
+    pcg32 rng = pcg32(seed, 0x6a09e667f3bcc909ULL);
+    patterns.resize(count);
+    for (int i = 0; i < count; i++) {
+        patterns[i] = multi_jitter_pattern(fine_grid, rng);
     }
-    return sample;
 }
 
 /**
- * Print a ppm file to display the multi-jitter sample grid, where black pixels represent the points to take a sample at. 
+ * Print a ppm file to display the multi-jitter sample grid, where black pixels represent the points to take a sample at.
  * This is purely for visualization and testing purposes.
  * @param fine_grid the size of the resulting image.
  **/
 inline void display_jitter_mask(int fine_grid) {
     cout << "P3\n" << fine_grid << ' ' << fine_grid << "\n255\n";
-    bool** sample = get_multi_jitter_mask(fine_grid);
-        
+    pcg32 rng = pcg32();
+    vector<sample_offset> samples = multi_jitter_pattern(fine_grid, rng);
+    vector<bool> sample(fine_grid * fine_grid, false);
+    for (int s = 0; s < (int) samples.size(); s++) {
+        sample[(int) (samples[s].x * fine_grid) * fine_grid + (int) (samples[s].y * fine_grid)] = true;
+    }
+
     for (int j = 0; j < fine_grid; ++j) {
         cerr << "\rScanlines done: " << j << ' ' << std::flush;
         for (int i = 0; i < fine_grid; ++i) {
-            if (sample[i][j]) {
+            if (sample[i * fine_grid + j]) {
                 write_color(cout, color(0,0,0));
             } else {
                 write_color(cout, color(1,1,1));
@@ -0,0 +1,203 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "vec3.h"
+#include "parallel.h"
+#include <vector>
+#include <cstdint>
+
+using std::vector;
+
+/**
+ * A primitive's Morton code and its index in the original list
+ */
+struct morton_primitive {
+    uint64_t code;
+    int index;
+};
+
+/**
+ * The children of one internal node of a linear BVH. Each child is either another internal node
+ * or a leaf, where leaf i is the i-th primitive in Morton order.
+ */
+struct lbvh_split {
+    int left;
+    int right;
+    bool left_is_leaf;
+    bool right_is_leaf;
+};
+
+/**
+ * Spreads the lowest 10 bits of v out so there are two zero bits between each of them
+ */
+inline uint64_t expand_bits_10(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+/**
+ * Spreads the lowest 21 bits of v out so there are two zero bits between each of them
+ */
+inline uint64_t expand_bits_21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffULL;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+}
+
+/**
+ * Calculates the Morton code of a point by interleaving the bits of its quantized coordinates
+ * @param p: the point, with every coordinate in [0, 1]
+ * @param bits: 30 for 10 bits per axis or 63 for 21 bits per axis
+ * @return the Morton code, using the lowest `bits` bits
+ */
+inline uint64_t morton_code(const point3& p, int bits) {
+    int axis_bits = bits / 3;
+    double scale = (double) (1 << axis_bits);
+    uint64_t coords[3];
+    for (int i = 0; i < 3; i++) {
+        double q = fmin(fmax(p[i] * scale, 0.0), scale - 1);
+        coords[i] = (uint64_t) q;
+    }
+
+    if (axis_bits > 10) {
+        return (expand_bits_21(coords[0]) << 2) | (expand_bits_21(coords[1]) << 1) | expand_bits_21(coords[2]);
+    }
+    return (expand_bits_10(coords[0]) << 2) | (expand_bits_10(coords[1]) << 1) | expand_bits_10(coords[2]);
+}
+
+/**
+ * Sorts the primitives by Morton code with a least significant digit radix sort, 8 bits per pass.
+ * Each thread counts the digits in its own chunk, and then scatters its chunk into place using
+ * offsets computed from every thread's counts, so the sort stays stable.
+ * @param items: the primitives to sort
+ * @param key_bits: the number of low bits of the code that are used
+ * @param threads: the number of threads to sort with, 0 for every core
+ */
+inline void radix_sort(vector<morton_primitive>& items, int key_bits, int threads) {
+    const int digit_bits = 8;
+    const int buckets = 1 << digit_bits;
+    int n = items.size();
+    threads = std::min(thread_count(threads), std::max(n / 65536, 1));
+
+    vector<morton_primitive> scratch(n);
+    vector<int> counts(threads * buckets);
+    for (int shift = 0; shift < key_bits; shift += digit_bits) {
+        std::fill(counts.begin(), counts.end(), 0);
+        int chunk = (n + threads - 1) / threads;
+
+        parallel_for(0, threads, threads, [&](int first, int last, int) {
+            for (int t = first; t < last; t++) {
+                int* count = &counts[t * buckets];
+                int end = std::min((t + 1) * chunk, n);
+                for (int i = t * chunk; i < end; i++) {
+                    count[(items[i].code >> shift) & (buckets - 1)]++;
+                }
+            }
+        });
+
+        // turn the counts into starting offsets, ordered by digit and then by thread
+        int offset = 0;
+        for (int b = 0; b < buckets; b++) {
+            for (int t = 0; t < threads; t++) {
+                int count = counts[t * buckets + b];
+                counts[t * buckets + b] = offset;
+                offset += count;
+            }
+        }
+
+        parallel_for(0, threads, threads, [&](int first, int last, int) {
+            for (int t = first; t < last; t++) {
+                int* next = &counts[t * buckets];
+                int end = std::min((t + 1) * chunk, n);
+                for (int i = t * chunk; i < end; i++) {
+                    scratch[next[(items[i].code >> shift) & (buckets - 1)]++] = items[i];
+                }
+            }
+        });
+        items.swap(scratch);
+    }
+}
+
+/**
+ * The length of the common prefix of the codes of sorted primitives i and j. Equal codes
+ * fall back to comparing the indices, so every key is unique.
+ * @return the prefix length, or -1 if j is out of range
+ */
+inline int common_prefix(const vector<morton_primitive>& sorted, int i, int j) {
+    if (j < 0 || j >= (int) sorted.size()) {
+        return -1;
+    }
+    uint64_t a = sorted[i].code;
+    uint64_t b = sorted[j].code;
+    if (a == b) {
+        return 64 + __builtin_clz((unsigned int) (i ^ j));
+    }
+    return __builtin_clzll(a ^ b);
+}
+
+/**
+ * Builds the topology of a binary radix tree over the sorted codes (Karras 2012). Every internal node
+ * finds its range and split position independently, so the nodes are emitted in parallel in O(n).
+ * Internal node 0 is the root.
+ * @param sorted: the primitives sorted by Morton code, at least two of them
+ * @param internal: filled with the n - 1 internal nodes
+ * @param parents: filled with the parent of each internal node followed by the parent of each leaf
+ * @param threads: the number of threads to use, 0 for every core
+ */
+inline void emit_radix_tree(const vector<morton_primitive>& sorted, vector<lbvh_split>& internal,
+                            vector<int>& parents, int threads) {
+    int n = sorted.size();
+    internal.resize(n - 1);
+    parents.assign(2 * n - 1, -1);
+
+    parallel_for(0, n - 1, threads, [&](int first, int last, int) {
+        for (int i = first; i < last; i++) {
+            // the direction of the range from i
+            int d = common_prefix(sorted, i, i + 1) - common_prefix(sorted, i, i - 1) > 0 ? 1 : -1;
+
+            // find the other end of the range with an exponential then binary search
+            int prefix_min = common_prefix(sorted, i, i - d);
+            int length_max = 2;
+            while (common_prefix(sorted, i, i + length_max * d) > prefix_min) {
+                length_max *= 2;
+            }
+            int length = 0;
+            for (int t = length_max / 2; t >= 1; t /= 2) {
+                if (common_prefix(sorted, i, i + (length + t) * d) > prefix_min) {
+                    length += t;
+                }
+            }
+            int j = i + length * d;
+
+            // find where the highest differing bit changes within the range
+            int prefix_node = common_prefix(sorted, i, j);
+            int split = 0;
+            int t = length;
+            do {
+                t = (t + 1) / 2;
+                if (common_prefix(sorted, i, i + (split + t) * d) > prefix_node) {
+                    split += t;
+                }
+            } while (t > 1);
+            int gamma = i + split * d + std::min(d, 0);
+
+            lbvh_split& node = internal[i];
+            node.left = gamma;
+            node.right = gamma + 1;
+            node.left_is_leaf = std::min(i, j) == gamma;
+            node.right_is_leaf = std::max(i, j) == gamma + 1;
+            parents[node.left_is_leaf ? n - 1 + node.left : node.left] = i;
+            parents[node.right_is_leaf ? n - 1 + node.right : node.right] = i;
+        }
+    });
+}
+
+#endif
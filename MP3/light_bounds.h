@@ -0,0 +1,177 @@
+#ifndef LIGHT_BOUNDS_H
+#define LIGHT_BOUNDS_H
+
+#include "vec3.h"
+#include "aabb.h"
+#include <cmath>
+#include <algorithm>
+
+/**
+ * cos(max(0, a - b)) given cos and sin of both angles, which is 1 when b covers a
+ */
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+    if (cos_a > cos_b) {
+        return 1;
+    }
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+/**
+ * sin(max(0, a - b)) given cos and sin of both angles
+ */
+inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+    if (cos_a > cos_b) {
+        return 0;
+    }
+    return sin_a * cos_b - cos_a * sin_b;
+}
+
+/**
+ * Bounds what a group of lights can give off: the box around them, their total power, and two cones.
+ * Every surface normal of the lights lies within theta_o of the axis w, and every normal emits up to
+ * theta_e away from itself. Two sided lights emit around both their normal and its opposite.
+ */
+struct light_bounds {
+    aabb bounds;
+    double phi = 0;
+    vec3 w = vec3(0, 0, 1);
+    double cos_theta_o = 1;
+    double cos_theta_e = 1;
+    bool two_sided = false;
+
+    light_bounds() {}
+    light_bounds(const aabb& box, double power, const vec3& axis, double cos_o, double cos_e, bool both_sides)
+        : bounds(box), phi(power), w(unit_vector(axis)), cos_theta_o(cos_o), cos_theta_e(cos_e), two_sided(both_sides) {}
+
+    double importance(const point3& p, const vec3& n) const;
+};
+
+/**
+ * The cosine of the half angle of the cone from p that contains the box, or -1 if p is inside it
+ */
+inline double bounding_cone_cosine(const aabb& box, const point3& p) {
+    point3 center = (box.min() + box.max()) / 2;
+    double radius_squared = (box.max() - center).length_squared();
+    double distance_squared = (p - center).length_squared();
+    if (distance_squared < radius_squared) {
+        return -1;
+    }
+    return sqrt(fmax(0.0, 1 - radius_squared / distance_squared));
+}
+
+/**
+ * A conservative estimate of how much light the bounded lights can send to a point. It is never 0 for
+ * a point the lights can actually reach, so picking lights by it stays unbiased.
+ * @param p: the point being lit
+ * @param n: the surface normal at p, or a zero vector to ignore the orientation of the point
+ * @return the estimate, which is only meaningful relative to other estimates for the same point
+ */
+double light_bounds::importance(const point3& p, const vec3& n) const {
+    if (phi <= 0) {
+        return 0;
+    }
+
+    // keep the distance from shrinking below the size of the box, since points inside it are not closer to every light
+    point3 center = (bounds.min() + bounds.max()) / 2;
+    double distance_squared = (p - center).length_squared();
+    distance_squared = fmax(distance_squared, (bounds.max() - bounds.min()).length() / 2);
+    vec3 wi = unit_vector(p - center);
+
+    // the angle between the emission axis and the direction to the point
+    double cos_theta_w = dot(w, wi);
+    if (two_sided) {
+        cos_theta_w = fabs(cos_theta_w);
+    }
+    double sin_theta_w = sqrt(fmax(0.0, 1 - cos_theta_w * cos_theta_w));
+
+    // the box covers a range of directions from p, which can bring the lights closer to facing it
+    double cos_theta_b = bounding_cone_cosine(bounds, p);
+    double sin_theta_b = sqrt(fmax(0.0, 1 - cos_theta_b * cos_theta_b));
+
+    // the smallest angle any normal can make with the direction to p, less the spread of the box
+    double sin_theta_o = sqrt(fmax(0.0, 1 - cos_theta_o * cos_theta_o));
+    double cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    double sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    double cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if (cos_theta_p <= cos_theta_e) {
+        return 0;
+    }
+
+    double result = phi * cos_theta_p / distance_squared;
+    if (n.length_squared() > 0) {
+        // the light arrives at p at an angle to its normal, which can also be lessened by the spread of the box
+        double cos_theta_i = fabs(dot(wi, n));
+        double sin_theta_i = sqrt(fmax(0.0, 1 - cos_theta_i * cos_theta_i));
+        result *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+    return fmax(result, 0.0);
+}
+
+/**
+ * Combines the bounds of two groups of lights, with a cone wide enough for both groups' normals
+ */
+inline light_bounds union_bounds(const light_bounds& a, const light_bounds& b) {
+    if (a.phi <= 0) {
+        return b;
+    }
+    if (b.phi <= 0) {
+        return a;
+    }
+
+    light_bounds result;
+    result.bounds = surrounding_box(a.bounds, b.bounds);
+    result.phi = a.phi + b.phi;
+    result.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+    result.two_sided = a.two_sided || b.two_sided;
+
+    // make a the wider cone, then check whether it already holds b
+    const light_bounds* wide = &a;
+    const light_bounds* narrow = &b;
+    if (b.cos_theta_o < a.cos_theta_o) {
+        std::swap(wide, narrow);
+    }
+    double theta_wide = acos(clip(wide->cos_theta_o, -1, 1));
+    double theta_narrow = acos(clip(narrow->cos_theta_o, -1, 1));
+    double theta_between = acos(clip(dot(wide->w, narrow->w), -1, 1));
+    if (fmin(theta_between + theta_narrow, M_PI) <= theta_wide) {
+        result.w = wide->w;
+        result.cos_theta_o = wide->cos_theta_o;
+        return result;
+    }
+
+    // otherwise spread a cone from the far edge of one to the far edge of the other
+    double theta_o = (theta_wide + theta_between + theta_narrow) / 2;
+    if (theta_o >= M_PI) {
+        result.w = wide->w;
+        result.cos_theta_o = -1;
+        return result;
+    }
+    double theta_rotate = theta_o - theta_wide;
+    vec3 rotation_axis = cross(wide->w, narrow->w);
+    if (rotation_axis.length_squared() == 0) {
+        result.w = wide->w;
+        result.cos_theta_o = -1;
+        return result;
+    }
+
+    // Rodrigues' rotation of the wide axis toward the narrow one
+    vec3 k = unit_vector(rotation_axis);
+    vec3 v = wide->w;
+    result.w = unit_vector(v * cos(theta_rotate) + cross(k, v) * sin(theta_rotate) + k * dot(k, v) * (1 - cos(theta_rotate)));
+    result.cos_theta_o = cos(theta_o);
+    return result;
+}
+
+/**
+ * The spread of directions a group of lights covers, used to cost splits while building the light tree
+ */
+inline double orientation_measure(const light_bounds& b) {
+    double theta_o = acos(clip(b.cos_theta_o, -1, 1));
+    double theta_e = acos(clip(b.cos_theta_e, -1, 1));
+    double theta_w = fmin(theta_o + theta_e, M_PI);
+    double sin_theta_o = sqrt(fmax(0.0, 1 - b.cos_theta_o * b.cos_theta_o));
+    return 2 * M_PI * (1 - b.cos_theta_o)
+           + M_PI / 2 * (2 * theta_w * sin_theta_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_theta_o + b.cos_theta_o);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,287 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "objs.h"
+#include "vec3.h"
+#include "aabb.h"
+#include "sampler.h"
+#include "light_bounds.h"
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+using std::vector;
+
+/**
+ * A node of the light tree, stored in depth-first order like linear_bvh_node, so the first child of an
+ * interior node is always the next node
+ */
+struct light_bvh_node {
+    /** bounds every light below the node */
+    light_bounds bounds;
+
+    /** leaf: index of the light. interior: index of the second child */
+    int offset;
+
+    bool leaf;
+};
+
+/**
+ * The objects of the scene that give off light, so that every diffuse hit can send a shadow ray to one of them.
+ * Lights are kept in a tree of light_bounds, and a light is picked by walking down the tree and choosing each
+ * child in proportion to how much its lights can give to the point being lit. With hundreds of lights this
+ * mostly picks the few that matter, and the walk only grows with the log of the light count.
+ */
+class light_list {
+    public:
+        light_list() {}
+        light_list(const vector<objs*>& objects, bool use_tree = true);
+
+        /** @return the number of lights */
+        int size() const {
+            return lights.size();
+        }
+
+        const objs* sample(const point3& p, const vec3& n, double u, double& pick_pdf) const;
+        double pick_pdf(const point3& p, const vec3& n, const objs* light) const;
+
+    public:
+        vector<const objs*> lights;
+        vector<light_bvh_node> nodes;
+
+        /** for each light, the children taken to reach its leaf from the root, one bit per level with the root's first */
+        std::unordered_map<const objs*, uint64_t> trails;
+
+        /** false picks every light with the same probability */
+        bool use_tree = true;
+
+    private:
+        int build(vector<int>& order, const vector<light_bounds>& bounds, int begin, int end, int depth, uint64_t trail);
+};
+
+/** the number of buckets the centroids are sorted into when looking for the best split */
+const int light_split_buckets = 12;
+
+/** below this depth lights are split in half, so no trail needs more than 64 bits */
+const int light_tree_max_depth = 40;
+
+/**
+ * Collects the objects that give off light that can be sampled, and builds the tree over them
+ * @param objects: every object in the scene
+ * @param use_tree: false to pick lights uniformly instead
+ */
+light_list::light_list(const vector<objs*>& objects, bool use_tree) : use_tree(use_tree) {
+    vector<light_bounds> bounds;
+    for (int i = 0; i < (int) objects.size(); i++) {
+        light_bounds b = objects[i]->emission_bounds();
+        if (b.phi > 0) {
+            lights.push_back(objects[i]);
+            bounds.push_back(b);
+        }
+    }
+    if (lights.empty()) {
+        return;
+    }
+
+    vector<int> order(lights.size());
+    for (int i = 0; i < (int) order.size(); i++) {
+        order[i] = i;
+    }
+    nodes.reserve(2 * lights.size() - 1);
+    build(order, bounds, 0, order.size(), 0, 0);
+}
+
+/**
+ * Recursively builds the tree over order[begin, end), splitting where the lights on each side are the
+ * most compact in space and direction for their power
+ * @param trail: the bits of the children taken to reach this node
+ * @return the index of the node
+ */
+int light_list::build(vector<int>& order, const vector<light_bounds>& bounds, int begin, int end, int depth, uint64_t trail) {
+    int index = nodes.size();
+    nodes.push_back(light_bvh_node());
+    if (end - begin == 1) {
+        nodes[index].bounds = bounds[order[begin]];
+        nodes[index].offset = order[begin];
+        nodes[index].leaf = true;
+        trails[lights[order[begin]]] = trail;
+        return index;
+    }
+
+    light_bounds all;
+    point3 centroid_min = bounds[order[begin]].bounds.centroid();
+    point3 centroid_max = centroid_min;
+    for (int i = begin; i < end; i++) {
+        all = union_bounds(all, bounds[order[i]]);
+        point3 c = bounds[order[i]].bounds.centroid();
+        centroid_min = point3(fmin(centroid_min.x(), c.x()), fmin(centroid_min.y(), c.y()), fmin(centroid_min.z(), c.z()));
+        centroid_max = point3(fmax(centroid_max.x(), c.x()), fmax(centroid_max.y(), c.y()), fmax(centroid_max.z(), c.z()));
+    }
+
+    // cost each bucket boundary along each axis, scaled so thin boxes are not favoured
+    vec3 extent = all.bounds.max() - all.bounds.min();
+    double max_extent = fmax(extent.x(), fmax(extent.y(), extent.z()));
+    double best_cost = std::numeric_limits<double>::infinity();
+    int best_axis = -1;
+    int best_bucket = -1;
+    for (int axis = 0; axis < 3 && depth < light_tree_max_depth; axis++) {
+        double range = centroid_max[axis] - centroid_min[axis];
+        if (range <= 0) {
+            continue;
+        }
+
+        light_bounds buckets[light_split_buckets];
+        for (int i = begin; i < end; i++) {
+            int b = (int) (light_split_buckets * (bounds[order[i]].bounds.centroid()[axis] - centroid_min[axis]) / range);
+            b = std::min(b, light_split_buckets - 1);
+            buckets[b] = union_bounds(buckets[b], bounds[order[i]]);
+        }
+
+        double scale = extent[axis] > 0 ? max_extent / extent[axis] : 1;
+        for (int split = 0; split < light_split_buckets - 1; split++) {
+            light_bounds below;
+            light_bounds above;
+            for (int b = 0; b <= split; b++) {
+                below = union_bounds(below, buckets[b]);
+            }
+            for (int b = split + 1; b < light_split_buckets; b++) {
+                above = union_bounds(above, buckets[b]);
+            }
+            double cost = 0;
+            if (below.phi > 0) {
+                cost += below.phi * orientation_measure(below) * below.bounds.surface_area();
+            }
+            if (above.phi > 0) {
+                cost += above.phi * orientation_measure(above) * above.bounds.surface_area();
+            }
+            cost *= scale;
+            if (cost > 0 && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bucket = split;
+            }
+        }
+    }
+
+    int mid = begin;
+    if (best_axis >= 0) {
+        double range = centroid_max[best_axis] - centroid_min[best_axis];
+        mid = std::partition(order.begin() + begin, order.begin() + end, [&](int light) {
+            int b = (int) (light_split_buckets * (bounds[light].bounds.centroid()[best_axis] - centroid_min[best_axis]) / range);
+            return std::min(b, light_split_buckets - 1) <= best_bucket;
+        }) - order.begin();
+    }
+    if (mid == begin || mid == end) {
+        // every light sits in the same spot, or the trail is running out of bits, so just halve them
+        mid = (begin + end) / 2;
+    }
+
+    build(order, bounds, begin, mid, depth + 1, trail);
+    int second = build(order, bounds, mid, end, depth + 1, trail | ((uint64_t) 1 << depth));
+    nodes[index].bounds = all;
+    nodes[index].offset = second;
+    nodes[index].leaf = false;
+    return index;
+}
+
+/**
+ * Picks the light to sample for a point, in proportion to how much each light can give to it
+ * @param p: the point being lit
+ * @param n: the surface normal at p
+ * @param u: a random number in [0, 1)
+ * @param pick_pdf: set to the probability of picking the returned light
+ * @return the light, or NULL if no light can reach the point
+ */
+const objs* light_list::sample(const point3& p, const vec3& n, double u, double& pick_pdf) const {
+    pick_pdf = 0;
+    if (lights.empty()) {
+        return NULL;
+    }
+    if (!use_tree) {
+        int index = std::min((int) (u * lights.size()), (int) lights.size() - 1);
+        pick_pdf = 1.0 / lights.size();
+        return lights[index];
+    }
+
+    int index = 0;
+    double pmf = 1;
+    while (!nodes[index].leaf) {
+        double first = nodes[index + 1].bounds.importance(p, n);
+        double second = nodes[nodes[index].offset].bounds.importance(p, n);
+        if (first <= 0 && second <= 0) {
+            return NULL;
+        }
+
+        // pick a child and stretch the part of u that picked it back over [0, 1) for the next level
+        double first_probability = first / (first + second);
+        if (u < first_probability) {
+            index = index + 1;
+            pmf *= first_probability;
+            u = fmin(u / first_probability, 0.99999999999999989);
+        } else {
+            index = nodes[index].offset;
+            pmf *= 1 - first_probability;
+            u = fmin((u - first_probability) / (1 - first_probability), 0.99999999999999989);
+        }
+    }
+
+    // a tree with a single light has not checked that the light can reach the point yet
+    if (index == 0 && nodes[0].bounds.importance(p, n) <= 0) {
+        return NULL;
+    }
+    pick_pdf = pmf;
+    return lights[nodes[index].offset];
+}
+
+/**
+ * The probability of sample picking the given light for a point
+ * @return the probability, or 0 if the object is not a light
+ */
+double light_list::pick_pdf(const point3& p, const vec3& n, const objs* light) const {
+    auto found = trails.find(light);
+    if (found == trails.end()) {
+        return 0;
+    }
+    if (!use_tree) {
+        return 1.0 / lights.size();
+    }
+
+    // follow the light's trail down the tree, taking the same probabilities sample would
+    uint64_t trail = found->second;
+    int index = 0;
+    double pmf = 1;
+    while (!nodes[index].leaf) {
+        double first = nodes[index + 1].bounds.importance(p, n);
+        double second = nodes[nodes[index].offset].bounds.importance(p, n);
+        if (first <= 0 && second <= 0) {
+            return 0;
+        }
+        if (trail & 1) {
+            pmf *= second / (first + second);
+            index = nodes[index].offset;
+        } else {
+            pmf *= first / (first + second);
+            index = index + 1;
+        }
+        trail >>= 1;
+    }
+    if (index == 0 && nodes[0].bounds.importance(p, n) <= 0) {
+        return 0;
+    }
+    return pmf;
+}
+
+/**
+ * Veach's power heuristic with an exponent of 2, for weighting a sample drawn with density a against
+ * another technique that could have drawn it with density b
+ */
+inline double power_heuristic(double a, double b) {
+    if (a <= 0) {
+        return 0;
+    }
+    return (a * a) / (a * a + b * b);
+}
+
+#endif
\ No newline at end of file
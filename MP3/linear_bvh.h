@@ -0,0 +1,357 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "objs.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "bvh_node.h"
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+using std::vector;
+
+/**
+ * A single node of the flattened BVH, packed into 32 bytes so two nodes share a cache line.
+ * Nodes are stored in depth-first order, so the first child of an interior node is always the next node.
+ */
+struct linear_bvh_node {
+    /** the min and max points of the node's bounding box */
+    float min[3];
+    float max[3];
+
+    /** leaf: index of the first primitive. interior: index of the second child */
+    int offset;
+
+    /** the number of primitives in a leaf, 0 for interior nodes */
+    unsigned short count;
+
+    /** the axis the children are separated along, used to visit the nearer child first */
+    unsigned char axis;
+    unsigned char pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+/**
+ * Pointer-free version of a bvh_node tree. The tree is built with bvh_node and then compacted into
+ * a contiguous array of nodes that is traversed with an explicit stack instead of recursion.
+ */
+class linear_bvh : public objs {
+    public:
+        linear_bvh() {};
+        linear_bvh(const bvh_node& root);
+
+        std::string type() const {
+            return "linear bvh";
+        }
+
+        color kDiffuse() const {
+            return color(-10,-10,-10);
+        }
+
+        vec3 surface_normal(const point3 position) const {
+            return vec3(-10.0,-10.0,-10.0);
+        }
+
+        aabb bounding_box() const {
+            return bbox;
+        }
+
+        /** hits are finalized by the primitive that was hit */
+        void finalize_hit(const ray& r, hit_record& rec) const {}
+
+        virtual bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+        bool check_nodes();
+
+    private:
+        int flatten(const objs* node, int level);
+        int add_leaf(const aabb& box, const vector<const objs*>& leaf_primitives);
+        bool node_intersection(const linear_bvh_node& node, const float origin[3], const float inv_dir[3],
+                               const int dir_is_neg[3], float tmin, float tmax) const;
+
+    public:
+        vector<linear_bvh_node> nodes;
+        vector<objs*> primitives;
+        aabb bbox;
+
+        /** the most interior nodes on any path from the root, which is the most entries the traversal stack holds */
+        int depth = 0;
+};
+
+/** the largest tree depth the traversal stack on the call stack can hold, deeper trees use a heap stack */
+const int linear_bvh_stack_size = 128;
+
+/**
+ * Linear BVH constructor
+ * Flattens the tree below root into the node array in depth-first order
+ * @param root: the root of a tree built by bvh_node
+ */
+linear_bvh::linear_bvh(const bvh_node& root) {
+    if (root.left == NULL && !root.is_leaf()) {
+        return;
+    }
+    bbox = root.bounding_box();
+    flatten(&root, 1);
+}
+
+/**
+ * Appends a leaf node holding the given primitives
+ * @param box: the bounding box around the primitives
+ * @param leaf_primitives: the primitives to store in the leaf
+ * @return the index of the new node
+ */
+int linear_bvh::add_leaf(const aabb& box, const vector<const objs*>& leaf_primitives) {
+    linear_bvh_node node;
+    for (int i = 0; i < 3; i++) {
+        node.min[i] = float_below(box.min()[i]);
+        node.max[i] = float_above(box.max()[i]);
+    }
+    node.offset = primitives.size();
+    node.count = leaf_primitives.size();
+    node.axis = 0;
+    node.pad = 0;
+    for (int o = 0; o < (int) leaf_primitives.size(); o++) {
+        primitives.push_back((objs*) leaf_primitives[o]);
+    }
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+/**
+ * Recursively copies the subtree into the node array.
+ * A bvh_node whose children are both primitives becomes a single leaf holding both of them.
+ * @param node: either a bvh_node or a primitive
+ * @param level: the number of interior nodes from the root down to and including this one, if it is interior
+ * @return the index of the node that was created for the subtree
+ */
+int linear_bvh::flatten(const objs* node, int level) {
+    const bvh_node* tree = dynamic_cast<const bvh_node*>(node);
+    vector<const objs*> leaf_primitives;
+    if (tree == NULL) {
+        leaf_primitives.push_back(node);
+        return add_leaf(node->bounding_box(), leaf_primitives);
+    }
+
+    if (tree->is_leaf()) {
+        leaf_primitives.assign(tree->primitives.begin(), tree->primitives.end());
+        return add_leaf(tree->bounding_box(), leaf_primitives);
+    }
+
+    bool left_is_tree = dynamic_cast<const bvh_node*>(tree->left) != NULL;
+    bool right_is_tree = dynamic_cast<const bvh_node*>(tree->right) != NULL;
+    if (!left_is_tree && !right_is_tree) {
+        leaf_primitives.push_back(tree->left);
+        if (tree->right != tree->left) {
+            leaf_primitives.push_back(tree->right);
+        }
+        return add_leaf(tree->bounding_box(), leaf_primitives);
+    }
+
+    // pick the axis that separates the two children the most
+    point3 left_center = tree->left->bounding_box().centroid();
+    point3 right_center = tree->right->bounding_box().centroid();
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (fabs(right_center[i] - left_center[i]) > fabs(right_center[axis] - left_center[axis])) {
+            axis = i;
+        }
+    }
+
+    linear_bvh_node interior;
+    aabb box = tree->bounding_box();
+    for (int i = 0; i < 3; i++) {
+        interior.min[i] = float_below(box.min()[i]);
+        interior.max[i] = float_above(box.max()[i]);
+    }
+    interior.count = 0;
+    interior.axis = axis;
+    interior.pad = 0;
+
+    // the children should be ordered low to high along the axis
+    const objs* first = tree->left;
+    const objs* second = tree->right;
+    if (right_center[axis] < left_center[axis]) {
+        std::swap(first, second);
+    }
+
+    depth = std::max(depth, level);
+    int index = nodes.size();
+    nodes.push_back(interior);
+    flatten(first, level + 1);
+    int second_index = flatten(second, level + 1);
+    nodes[index].offset = second_index;
+    return index;
+}
+
+/**
+ * Checks that the nodes form a tree that only refers to nodes and primitives inside the arrays, and sets
+ * depth from it. Trees made by flatten always do, this is for nodes that were filled in some other way.
+ * @return false if a node is out of range or reached twice
+ */
+bool linear_bvh::check_nodes() {
+    depth = 0;
+    int node_count = nodes.size();
+    int primitive_count = primitives.size();
+    if (node_count == 0) {
+        return true;
+    }
+
+    // the children of a node always come after it, so a walk from the root reaches each node of a valid tree once
+    vector<std::pair<int, int>> pending;
+    pending.push_back(std::make_pair(0, 1));
+    int visited = 0;
+    while (!pending.empty()) {
+        int index = pending.back().first;
+        int level = pending.back().second;
+        pending.pop_back();
+        if (++visited > node_count) {
+            return false;
+        }
+
+        const linear_bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            if (node.offset < 0 || node.offset > primitive_count - node.count) {
+                return false;
+            }
+            continue;
+        }
+        if (index + 1 >= node_count || node.offset <= index + 1 || node.offset >= node_count || node.axis > 2) {
+            return false;
+        }
+        depth = std::max(depth, level);
+        pending.push_back(std::make_pair(index + 1, level + 1));
+        pending.push_back(std::make_pair(node.offset, level + 1));
+    }
+    return true;
+}
+
+/**
+ * Slab test between the ray and the node's bounding box, in float on the stored float bounds.
+ * The bounds were rounded outward when they were stored and a ray that only grazes the box still counts,
+ * so a flat box around an axis aligned quad is never culled.
+ * The near and far planes of each slab are picked by the sign of the direction, so no min or max of the two is needed.
+ * @param origin, inv_dir: the ray origin and 1 / r.direction()
+ * @param dir_is_neg: 1 for each axis the direction is negative along, which makes max the near plane
+ * @return true if the ray passes through the box between tmin and tmax
+ */
+inline bool linear_bvh::node_intersection(const linear_bvh_node& node, const float origin[3], const float inv_dir[3],
+                                          const int dir_is_neg[3], float tmin, float tmax) const {
+    const float* planes[2] = { node.min, node.max };
+    for (int i = 0; i < 3; i++) {
+        float tnear = (planes[dir_is_neg[i]][i] - origin[i]) * inv_dir[i];
+        float tfar = (planes[1 - dir_is_neg[i]][i] - origin[i]) * inv_dir[i];
+        // a NaN from a flat slab seen edge on fails both comparisons and leaves the range as it was
+        tmin = std::max(tmin, tnear);
+        tmax = std::min(tmax, tfar);
+        if (tmax < tmin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Walks the node array with an explicit stack, visiting the nearer child of each node first
+ * so that the farther child can be culled with the closest hit found so far.
+ */
+bool linear_bvh::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    float origin[3] = { (float) r.orig[0], (float) r.orig[1], (float) r.orig[2] };
+    float inv_dir[3] = { 1.0f / (float) r.dir[0], 1.0f / (float) r.dir[1], 1.0f / (float) r.dir[2] };
+    int dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+
+    int local_stack[linear_bvh_stack_size];
+    vector<int> heap_stack;
+    int* stack = local_stack;
+    if (depth > linear_bvh_stack_size) {
+        heap_stack.resize(depth);
+        stack = heap_stack.data();
+    }
+    int stack_size = 0;
+    int current = 0;
+    bool hit = false;
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        COUNT_RAY_STAT(nodes_visited, 1);
+        COUNT_RAY_STAT(box_tests, 1);
+        if (node_intersection(node, origin, inv_dir, dir_is_neg, tmin, hit ? rec.t : tmax)) {
+            if (node.count > 0) {
+                for (int o = 0; o < node.count; o++) {
+                    if (primitives[node.offset + o]->ray_intersection(r, rec, tmin, hit ? rec.t : tmax)) {
+                        hit = true;
+                    }
+                }
+            } else if (dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (stack_size == 0) {
+            break;
+        }
+        current = stack[--stack_size];
+    }
+    return hit;
+}
+
+/**
+ * Walks the node array until any primitive is hit between tmin and tmax. The order the children
+ * are visited in does not matter since the first hit ends the search.
+ */
+bool linear_bvh::occluded(const ray& r, double tmin, double tmax) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    float origin[3] = { (float) r.orig[0], (float) r.orig[1], (float) r.orig[2] };
+    float inv_dir[3] = { 1.0f / (float) r.dir[0], 1.0f / (float) r.dir[1], 1.0f / (float) r.dir[2] };
+    int dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+
+    int local_stack[linear_bvh_stack_size];
+    vector<int> heap_stack;
+    int* stack = local_stack;
+    if (depth > linear_bvh_stack_size) {
+        heap_stack.resize(depth);
+        stack = heap_stack.data();
+    }
+    int stack_size = 0;
+    int current = 0;
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        COUNT_RAY_STAT(nodes_visited, 1);
+        COUNT_RAY_STAT(box_tests, 1);
+        if (node_intersection(node, origin, inv_dir, dir_is_neg, tmin, tmax)) {
+            if (node.count > 0) {
+                for (int o = 0; o < node.count; o++) {
+                    if (primitives[node.offset + o]->occluded(r, tmin, tmax)) {
+                        return true;
+                    }
+                }
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (stack_size == 0) {
+            break;
+        }
+        current = stack[--stack_size];
+    }
+    return false;
+}
+
+#endif
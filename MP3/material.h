@@ -1,6 +1,8 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include "sampler.h"
+
 struct hit_record; 
 
 /**
@@ -13,10 +15,11 @@ class material {
          * @param r: the ray being shot at the material
          * @param rec: hit record storing the intersection results
          * @param scattered: holds the calculated scattered ray
+         * @param u: the sampler's random numbers for this bounce
          * @return true if ray is scattered, false otherwise
          */
         virtual bool scatter(
-            const ray& r, const hit_record& rec, ray& scattered
+            const ray& r, const hit_record& rec, ray& scattered, const bounce_sample& u
         ) const = 0;
 
         /**
@@ -26,6 +29,24 @@ class material {
         virtual color emitted() const {
             return color(0, 0, 0);
         }
+
+        /**
+         * Specular materials scatter into a single direction, so lights can not be sampled for them
+         * @return true if the material is specular
+         */
+        virtual bool is_specular() const {
+            return false;
+        }
+
+        /**
+         * The probability density of scatter choosing the given direction, per unit solid angle
+         * @param rec: hit record storing the intersection results
+         * @param direction: the scattered direction, which does not need to be normalized
+         * @return the density
+         */
+        virtual double scatter_pdf(const hit_record& rec, const vec3& direction) const {
+            return 0;
+        }
 };
 
 /**
@@ -33,14 +54,19 @@ class material {
  */
 class lambertian : public material {
     public: 
-        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered) const override {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
+        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered, const bounce_sample& u) const override {
+            vec3 scatter_direction = rec.normal + uniform_sphere(u.direction.x, u.direction.y);
             if (scatter_direction.near_zero()) {
                 scatter_direction = rec.normal;
             }
             scattered = ray(rec.p, scatter_direction);
             return true;
         }
+
+        /** the normal plus a random unit vector is distributed by the cosine to the normal */
+        virtual double scatter_pdf(const hit_record& rec, const vec3& direction) const override {
+            return fmax(0.0, dot(rec.normal, unit_vector(direction))) / M_PI;
+        }
 };
 
 /**
@@ -49,11 +75,15 @@ class lambertian : public material {
 class mirror : public material {
     public: 
         mirror(double f) : fuzz(f < 1 ? f : 1) {}
-        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered) const override{
+        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered, const bounce_sample& u) const override{
             vec3 reflected = reflect(r.direction(), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+            scattered = ray(rec.p, reflected + fuzz * uniform_ball(u.direction.x, u.direction.y, u.lobe));
             return (dot(scattered.direction(), rec.normal) > 0);
         }
+
+        virtual bool is_specular() const override {
+            return true;
+        }
     public:
         double fuzz;
 };
@@ -64,7 +94,7 @@ class mirror : public material {
 class glass : public material {
     public: 
         glass(double index) : ior(index) {}
-        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered) const override{
+        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered, const bounce_sample& u) const override{
             double refraction_ratio;
             vec3 n = rec.normal;
             if (dot(r.direction(), rec.normal) < 0) {
@@ -79,7 +109,7 @@ class glass : public material {
 
             bool cant_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
-            if (cant_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+            if (cant_refract || reflectance(cos_theta, refraction_ratio) > u.lobe) {
                 direction = reflect(unit_direction, n);
             } else {
                 direction = refract(unit_direction, n, refraction_ratio);
@@ -88,6 +118,10 @@ class glass : public material {
             return true;
         }
 
+        virtual bool is_specular() const override {
+            return true;
+        }
+
     public:
         double ior;
     
@@ -108,7 +142,7 @@ class glass : public material {
 class area_light : public material {
     public: 
         area_light(const color& emit) : c(emit) {}
-        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered) const override{
+        virtual bool scatter(const ray& r, const hit_record& rec, ray& scattered, const bounce_sample& u) const override{
             return false;
         }
         virtual color emitted() const override {
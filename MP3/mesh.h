@@ -3,86 +3,56 @@
 
 #include "vec3.h"
 #include "triangle.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
 #include <vector>
 #include <stdlib.h>
 #include <iostream>
-#include <fstream>
 #include <string>
 
 using namespace std;
 
 class mesh {
     public: 
-        mesh(const string filename, const color& kDiffuse, material* m);
+        mesh(const string filename, const color& kDiffuse, material* m, int threads = 0);
 
-        vector<vec3*> get_vertices() {
-            return vertices;
+        const vector<point3>& get_vertices() {
+            return triangles->positions;
         }
         
         vector<objs*> get_faces() {
-            return faces;
+            return triangles->get_faces();
         }
 
-        void calculate_normals();
-
     public:
-        vector<vec3*> vertices;
-        vector<objs*> faces;
-        vector<vec3*> indices;
+        /** the loaded triangles, which stay alive after the mesh goes out of scope so the BVH can refer to them */
+        triangle_mesh* triangles;
+        /** false if the obj file could not be opened, which leaves the mesh without triangles */
+        bool loaded = false;
 };
 
 /**
  * Constructor for mesh
  * @param filename: the obj file to load the mesh from
  * @param kDiffuse: the color to shade the mesh
+ * @param threads: the number of threads to load the file and compute the normals with, 0 for every core.
+ * Check loaded afterwards, since a file that could not be opened gives an empty mesh.
  */
-mesh::mesh(const string filename, const color& kDiffuse, material* m) {
-    ifstream file(filename);
-    string str;
-    char a;
-    float x, y, z;
-    int i = 0;
-
-    while (file >> a >> x >> y >> z) {
-        if (a == 'v') {
-            vertices.push_back(new vec3(x, y, z));
-        }
-        if (a == 'f') {
-            triangle* t = new triangle(*vertices[x - 1], *vertices[y - 1], *vertices[z - 1], kDiffuse, m);
-            faces.push_back(t);
-            indices.push_back(new vec3(x - 1, y - 1, z - 1));
-        }
-        i++;
-    }
-    
-    calculate_normals();
-}
-
-/**
- * Compute the per vertex normals using area weighted averaging of the surrounding triangle faces
- */
-void mesh::calculate_normals() {
-    vector<vec3> normals(vertices.size());
-    
-    for (int i = 0; i < faces.size(); i++) {
-        vec3 normal = 0.5 * faces[i]->surface_normal(point3(0.0,0.0,0.0));
-        vec3 index = *indices[i];
-
-        normals[index.x()] = (normal) + normals[index.x()];
-        normals[index.y()] = (normal) + normals[index.y()];
-        normals[index.z()] = (normal) + normals[index.z()];
+mesh::mesh(const string filename, const color& kDiffuse, material* m, int threads) {
+    obj_data data;
+    obj_load_stats stats;
+    loaded = load_obj(filename, data, stats, threads);
+
+    triangles = new triangle_mesh(data.positions, data.position_indices, kDiffuse, m, threads);
+    if (!loaded) {
+        return;
     }
-
-    for (int i = 0; i < normals.size(); i++) {
-        normals[i] = unit_vector(normals[i]);
+    if (!data.normals.empty()) {
+        triangles->set_vertex_normals(data.normals, data.normal_indices);
     }
 
-    // store the per vertex normal in the triangle
-    for (int i = 0; i < faces.size(); i++) {
-        triangle* t = (triangle*) faces[i];
-        vec3* index = indices[i];
-        t->set_vertex_normals(normals[index->x()], normals[index->y()], normals[index->z()]);
-    }
+    cerr << "loaded " << filename << ": " << triangles->size() << " triangles, " << stats.bytes / 1e6 << " MB in "
+         << stats.seconds << "s on " << stats.threads << " threads (" << stats.throughput() << " MB/s)\n";
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,270 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "vec3.h"
+#include "bvh_node.h"
+#include "linear_bvh.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+using std::vector;
+using std::string;
+
+/** bump whenever the layout of the cache file or of anything stored in it changes */
+const uint32_t mesh_cache_version = 2;
+
+/**
+ * Identifies the contents a cache file was built from: a hash of the obj file's bytes and a hash
+ * of every build setting that changes the shape of the tree
+ */
+struct mesh_cache_key {
+    string path;
+    uint64_t file_hash = 0;
+    uint64_t settings_hash = 0;
+    bool valid = false;
+
+    mesh_cache_key() {}
+    mesh_cache_key(const string& obj_filename, const bvh_options& options);
+};
+
+/**
+ * The start of a cache file. The sections follow it in the order listed, each starting at its offset
+ */
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_size;
+    uint32_t node_size;
+    uint32_t pad;
+    uint64_t file_hash;
+    uint64_t settings_hash;
+    double bounds[6];
+
+    uint64_t vertex_count;
+    uint64_t index_count;
+    uint64_t node_count;
+    uint64_t primitive_count;
+
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t indices_offset;
+    uint64_t nodes_offset;
+    uint64_t primitives_offset;
+    uint64_t file_size;
+};
+
+const char mesh_cache_magic[8] = { 'M', 'P', 'M', 'E', 'S', 'H', 'C', '\0' };
+
+/**
+ * 64 bit FNV-1a hash
+ * @param hash: the hash of the bytes before these, to hash several pieces as one
+ */
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hashes the build settings that change the tree. The thread count is left out since the
+ * builders produce the same tree with any number of threads.
+ */
+inline uint64_t hash_build_options(const bvh_options& options) {
+    int method = options.method;
+    int optimize = options.optimize_treelets;
+    uint64_t hash = fnv1a(&method, sizeof(method));
+    hash = fnv1a(&options.bins, sizeof(options.bins), hash);
+    hash = fnv1a(&options.traversal_cost, sizeof(options.traversal_cost), hash);
+    hash = fnv1a(&options.leaf_cost, sizeof(options.leaf_cost), hash);
+    hash = fnv1a(&options.max_leaf_size, sizeof(options.max_leaf_size), hash);
+    hash = fnv1a(&options.morton_bits, sizeof(options.morton_bits), hash);
+    hash = fnv1a(&optimize, sizeof(optimize), hash);
+    return fnv1a(&options.treelet_size, sizeof(options.treelet_size), hash);
+}
+
+/**
+ * Creates the key for an obj file and build settings. The cache is stored next to the obj file.
+ * @param obj_filename: the obj file the mesh is loaded from
+ * @param options: the settings the tree is built with
+ */
+mesh_cache_key::mesh_cache_key(const string& obj_filename, const bvh_options& options) {
+    path = obj_filename + ".cache";
+    mapped_file file(obj_filename);
+    if (!file.is_open()) {
+        return;
+    }
+    file_hash = fnv1a(file.data, file.size);
+    settings_hash = hash_build_options(options);
+    valid = true;
+}
+
+/** rounds offset up to a multiple of 16 bytes */
+inline uint64_t align_cache_offset(uint64_t offset) {
+    return (offset + 15) & ~(uint64_t) 15;
+}
+
+/**
+ * @return true if count elements of the given size starting at offset lie inside the file,
+ * and the offset is on the 16 byte boundary the writer starts every section on
+ */
+inline bool cache_section_fits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t file_size) {
+    return offset == align_cache_offset(offset) && offset <= file_size && count <= (file_size - offset) / element_size;
+}
+
+/**
+ * Loads a mesh and its flattened BVH from the cache file, if the cache matches the key.
+ * Every section, index and node is checked before use, so a damaged or edited cache is skipped instead of read past its end.
+ * @param key: the key of the obj file and build settings to look for
+ * @param kDiffuse: the color to shade the mesh
+ * @param m: the material of the mesh
+ * @param bvh: set to the cached tree over the mesh's triangles
+ * @return the mesh, or NULL if there is no usable cache
+ */
+inline triangle_mesh* load_mesh_cache(const mesh_cache_key& key, const color& kDiffuse, material* m, linear_bvh& bvh) {
+    if (!key.valid) {
+        return NULL;
+    }
+    mapped_file file(key.path);
+    if (!file.is_open() || file.size < sizeof(mesh_cache_header)) {
+        return NULL;
+    }
+
+    mesh_cache_header header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0 || header.version != mesh_cache_version
+            || header.vertex_size != sizeof(point3) || header.node_size != sizeof(linear_bvh_node)
+            || header.file_hash != key.file_hash || header.settings_hash != key.settings_hash
+            || header.file_size != file.size) {
+        return NULL;
+    }
+
+    // the counts are stored as 64 bits but used as ints, and the triangles are read three indices at a time
+    uint64_t int_limit = std::numeric_limits<int>::max();
+    if (header.vertex_count > int_limit || header.index_count > int_limit || header.index_count % 3 != 0
+            || header.node_count > int_limit || header.primitive_count > int_limit) {
+        return NULL;
+    }
+    if (!cache_section_fits(header.positions_offset, header.vertex_count, sizeof(point3), file.size)
+            || !cache_section_fits(header.normals_offset, header.vertex_count, sizeof(vec3), file.size)
+            || !cache_section_fits(header.indices_offset, header.index_count, sizeof(int), file.size)
+            || !cache_section_fits(header.nodes_offset, header.node_count, sizeof(linear_bvh_node), file.size)
+            || !cache_section_fits(header.primitives_offset, header.primitive_count, sizeof(int), file.size)) {
+        return NULL;
+    }
+
+    const point3* positions = (const point3*) (file.data + header.positions_offset);
+    const vec3* normals = (const vec3*) (file.data + header.normals_offset);
+    const int* indices = (const int*) (file.data + header.indices_offset);
+    const linear_bvh_node* nodes = (const linear_bvh_node*) (file.data + header.nodes_offset);
+    const int* primitives = (const int*) (file.data + header.primitives_offset);
+
+    int vertex_count = header.vertex_count;
+    for (uint64_t i = 0; i < header.index_count; i++) {
+        if (indices[i] < 0 || indices[i] >= vertex_count) {
+            return NULL;
+        }
+    }
+
+    triangle_mesh* mesh = new triangle_mesh(vector<point3>(positions, positions + header.vertex_count),
+                                            vector<int>(indices, indices + header.index_count),
+                                            vector<vec3>(normals, normals + header.vertex_count), kDiffuse, m);
+
+    vector<objs*> primitive_pointers(header.primitive_count);
+    for (uint64_t i = 0; i < header.primitive_count; i++) {
+        if (primitives[i] < 0 || primitives[i] >= mesh->size()) {
+            delete mesh;
+            return NULL;
+        }
+        primitive_pointers[i] = &mesh->triangles[primitives[i]];
+    }
+
+    bvh.nodes.assign(nodes, nodes + header.node_count);
+    bvh.primitives.swap(primitive_pointers);
+    bvh.bbox = aabb(vec3(header.bounds[0], header.bounds[1], header.bounds[2]),
+                    vec3(header.bounds[3], header.bounds[4], header.bounds[5]));
+    if (!bvh.check_nodes()) {
+        bvh = linear_bvh();
+        delete mesh;
+        return NULL;
+    }
+    return mesh;
+}
+
+/**
+ * Writes the mesh and the flattened BVH built over its triangles to the cache file
+ * @param key: the key of the obj file and build settings the mesh and tree came from
+ * @param mesh: the loaded mesh
+ * @param bvh: the tree built over mesh.get_faces()
+ * @return false if the cache could not be written
+ */
+inline bool save_mesh_cache(const mesh_cache_key& key, const triangle_mesh& mesh, const linear_bvh& bvh) {
+    if (!key.valid) {
+        return false;
+    }
+
+    // the tree refers to triangles by pointer, which are stored as indices into the mesh
+    vector<int> primitives(bvh.primitives.size());
+    for (int i = 0; i < (int) bvh.primitives.size(); i++) {
+        const mesh_triangle* triangle = dynamic_cast<const mesh_triangle*>(bvh.primitives[i]);
+        if (triangle == NULL || triangle->mesh != &mesh) {
+            return false;
+        }
+        primitives[i] = triangle->index;
+    }
+
+    mesh_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+    header.version = mesh_cache_version;
+    header.vertex_size = sizeof(point3);
+    header.node_size = sizeof(linear_bvh_node);
+    header.file_hash = key.file_hash;
+    header.settings_hash = key.settings_hash;
+    for (int i = 0; i < 3; i++) {
+        header.bounds[i] = bvh.bbox.min()[i];
+        header.bounds[3 + i] = bvh.bbox.max()[i];
+    }
+    header.vertex_count = mesh.positions.size();
+    header.index_count = mesh.indices.size();
+    header.node_count = bvh.nodes.size();
+    header.primitive_count = primitives.size();
+
+    header.positions_offset = align_cache_offset(sizeof(header));
+    header.normals_offset = align_cache_offset(header.positions_offset + header.vertex_count * sizeof(point3));
+    header.indices_offset = align_cache_offset(header.normals_offset + header.vertex_count * sizeof(vec3));
+    header.nodes_offset = align_cache_offset(header.indices_offset + header.index_count * sizeof(int));
+    header.primitives_offset = align_cache_offset(header.nodes_offset + header.node_count * sizeof(linear_bvh_node));
+    header.file_size = header.primitives_offset + header.primitive_count * sizeof(int);
+
+    vector<char> buffer(header.file_size, 0);
+    memcpy(buffer.data(), &header, sizeof(header));
+    memcpy(buffer.data() + header.positions_offset, mesh.positions.data(), header.vertex_count * sizeof(point3));
+    memcpy(buffer.data() + header.normals_offset, mesh.normals.data(), header.vertex_count * sizeof(vec3));
+    memcpy(buffer.data() + header.indices_offset, mesh.indices.data(), header.index_count * sizeof(int));
+    memcpy(buffer.data() + header.nodes_offset, bvh.nodes.data(), header.node_count * sizeof(linear_bvh_node));
+    memcpy(buffer.data() + header.primitives_offset, primitives.data(), header.primitive_count * sizeof(int));
+
+    // write to a temporary file first so a failed write never leaves a broken cache behind
+    string temporary = key.path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (out == NULL) {
+        return false;
+    }
+    bool written = fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+    written = fclose(out) == 0 && written;
+    if (!written || rename(temporary.c_str(), key.path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
\ No newline at end of file
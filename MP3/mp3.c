@@ -14,13 +14,26 @@
 #include "triangle.h"
 #include "aabb.h"
 #include "bvh_node.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "mesh_cache.h"
+#include "framebuffer.h"
+#include "parallel.h"
+#include "rng.h"
+#include "sampler.h"
+#include "lights.h"
+#include "adaptive.h"
+#include "timer.h"
 
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <ctime>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
 #include <limits>
+#include <atomic>
 
 using std::cout;
 using std::cerr;
@@ -32,9 +45,34 @@ using std::numeric_limits;
 // --------------------------------------- VARIABLES --------------------------------------- //
 static bool perspective = false;
 static bool jittering = false;
+static string accelerator = "linear";
+static bool cache_meshes = false;
+static int render_threads = 0;
+static int tile_size = 16;
+static uint64_t render_seed = 0;
+static string sampler_name = "random";
+static int samples_per_pixel = 0;
+static bool next_event_estimation = true;
+static bool light_tree = true;
+static bool adaptive = false;
+static double adaptive_threshold = 0.02;
+static int adaptive_min_spp = 16;
+static int adaptive_max_spp = 256;
+static const int adaptive_batch = 4;
+static string samples_image = "";
+static bool progressive = false;
+static double progressive_time_limit = 0;
+static double flush_seconds = 10;
+static string preview_image = "preview.ppm";
+static const int progressive_default_spp = 64;
+static image_format output_format = PPM_BINARY;
+static bool cost_heatmap = false;
+static double heatmap_max_cost = 0;
 static const int fine_grid = 400;
 static int coarse_grid = (int) sqrt(fine_grid);
-const int max_depth = 50;
+static const int jitter_pattern_count = 64;
+static int max_depth = 50;
+static int roulette_depth = 3;
 double infinity = numeric_limits<double>::infinity();
 
 // Image
@@ -70,8 +108,24 @@ const color white       = color(1.0, 1.0, 1.0);
 // Objects
 const int NUM_OBJECTS = 10;
 const double sphere_radius = 0.5;
+const int LIGHT_GRID = 16;
 vector<objs*> objects;
 bvh_node root;
+linear_bvh flat_root;
+wide_bvh<4> bvh4_root;
+wide_bvh<8> bvh8_root;
+
+// the multi-jittered sample patterns shared by every pixel
+jitter_pattern_pool jitter_patterns;
+
+bvh_options build_options;
+string trace_file = "";
+
+// the acceleration structure that rays are traced against
+objs* world = &flat_root;
+
+// the emissive objects, which diffuse hits send shadow rays to
+light_list lights;
 
 // Lighting and Shading
 const vec3 lightPosition = vec3(0.75, 0.75, 0.5);
@@ -133,10 +187,10 @@ color apply_shadows(color original, hit_record rec) {
     ray shadow_ray_before = ray(rec.p, lightPosition - rec.p);
     vec3 new_origin = shadow_ray_before.origin() + epsilon * shadow_ray_before.direction();
     ray shadow_ray = ray(new_origin, lightPosition - rec.p);
-    hit_record tmp;
     color shadow = original;
-    int i = 0;
-    bool hit = root.ray_intersection(shadow_ray, tmp, 0.001, infinity);
+
+    // the direction reaches the light at t = 1, so only objects in front of the light cast a shadow
+    bool hit = world->occluded(shadow_ray, 0.001, 1.0);
     if (hit) {
         shadow = shade(shadow, 0.4);
     }
@@ -144,33 +198,108 @@ color apply_shadows(color original, hit_record rec) {
 }
 
 /**
- * For each ray, determine what object is the closest and return the shaded color accordingly
- * @param r: the ray to shoot at all objects
- * @return the final color at the point after shading and shadows
+ * Lights a diffuse hit directly by sending a shadow ray to a point on one of the lights. The result is weighted
+ * with the power heuristic against the chance of the scattered ray reaching the same point.
+ * @param rec: the hit to light
+ * @param u: the random numbers of the bounce, of which the light ones are used
+ * @return the light arriving from the sampled light, already multiplied by the diffuse color
  */
-color ray_color(const ray& r, int depth) {
-    if (depth <= 0) {
+color sample_lights(const hit_record& rec, const bounce_sample& u) {
+    double pick_pdf;
+    const objs* light = lights.sample(rec.p, rec.normal, u.light, pick_pdf);
+    if (light == NULL) {
+        return black;
+    }
+
+    vec3 to_light = light->sample_point(rec.p, u.light_point) - rec.p;
+    double distance = to_light.length();
+    if (distance <= 0) {
+        return black;
+    }
+    vec3 dir = to_light / distance;
+    double cosine = dot(rec.normal, dir);
+    if (cosine <= 0) {
+        return black;
+    }
+
+    double light_pdf = pick_pdf * light->pdf(rec.p, dir);
+    if (light_pdf <= 0) {
+        return black;
+    }
+    COUNT_RAY_STAT(shadow_rays, 1);
+    if (world->occluded(ray(rec.p, dir), 0.001, distance * (1 - 1e-4))) {
         return black;
     }
+    double bsdf_pdf = rec.mat->scatter_pdf(rec, dir);
+    return rec.kD * light->emitted() * (cosine / M_PI) * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+}
+
+/**
+ * Follows a path from the given ray, bouncing it around the scene and adding up the light it finds along the way.
+ * The path's throughput is the product of the colors it has bounced off, and after roulette_depth bounces a dark
+ * path is ended at random, with the paths that continue brightened to make up for the ones that stopped.
+ * @param r: the ray to shoot at all objects
+ * @param sampler: supplies the random numbers of the sample being traced
+ * @return the final color at the point after shading and shadows
+ */
+color ray_color(ray r, sampler& sampler) {
+    color radiance = black;
+    color throughput = white;
+
+    // the diffuse hit the ray was scattered from, which already sampled the lights directly
+    bool has_previous = false;
+    point3 previous_p;
+    vec3 previous_normal;
+    double previous_pdf = 0;
 
     hit_record rec;
-    bool hit = root.ray_intersection(r, rec, 0.001, infinity);
+    for (int depth = 0; depth < max_depth; depth++) {
+        if (depth == 0) {
+            COUNT_RAY_STAT(primary_rays, 1);
+        } else {
+            COUNT_RAY_STAT(secondary_rays, 1);
+        }
+        if (!world->closest_hit(r, rec, 0.001, infinity)) {
+            // radiance += throughput * sky;
+            radiance += throughput * dark_gray;
+            break;
+        }
 
-    color to_return;
-    if (hit) {
-        ray scattered;
         color emitted = rec.mat->emitted();
-        if (rec.mat->scatter(r, rec, scattered)) {
-            to_return = emitted + rec.kD * ray_color(scattered, depth - 1);
-        } else {
-            return emitted;
+        if (next_event_estimation && has_previous) {
+            // only keep this path's share of a light the previous hit could also have sampled
+            double light_pdf = lights.pick_pdf(previous_p, previous_normal, rec.object) * rec.object->pdf(previous_p, r.direction());
+            emitted = emitted * power_heuristic(previous_pdf, light_pdf);
+        }
+        radiance += throughput * emitted;
+
+        ray scattered;
+        bounce_sample u = sampler.get_bounce();
+        if (!rec.mat->scatter(r, rec, scattered, u)) {
+            break;
+        }
+
+        has_previous = next_event_estimation && !rec.mat->is_specular();
+        if (has_previous) {
+            radiance += throughput * sample_lights(rec, u);
+            previous_p = rec.p;
+            previous_normal = rec.normal;
+            previous_pdf = rec.mat->scatter_pdf(rec, scattered.direction());
         }
-        // to_return = phong_reflection(rec.normal, rec.p, rec.kD);
-        // to_return = apply_shadows(to_return, rec);
-        return to_return;
-    }  
-    // return sky;
-    return dark_gray;
+        throughput = throughput * rec.kD;
+        r = scattered;
+
+        if (depth + 1 >= roulette_depth) {
+            double survive = fmax(throughput.x(), fmax(throughput.y(), throughput.z()));
+            if (survive < 1) {
+                if (u.roulette >= survive) {
+                    break;
+                }
+                throughput = throughput / survive;
+            }
+        }
+    }
+    return radiance;
 }
 
 /**
@@ -187,50 +316,319 @@ vec3 get_pixel_center(int i, int j) {
 /**
  * Calculates the sample coordinate within a single pixel
  * @param (i, j): the pixel coordinates in the image
- * @param (k, l): the sample position within the grid
+ * @param offset: the sample position within the pixel
  * @return a coordinate within the pixel in the view plane
  */
-vec3 get_grid_pixel_center(int i, int j, int k, int l) {
-    double delta_x = (k + 0.5) / fine_grid;
-    double delta_y = (l + 0.5) / fine_grid;
-    double x = s * (i - image_width / 2 + delta_x);
-    double y = s * (j - image_height / 2 + delta_y);
+vec3 get_grid_pixel_center(int i, int j, const sample_offset& offset) {
+    double x = s * (i - image_width / 2 + offset.x);
+    double y = s * (j - image_height / 2 + offset.y);
     return vec3(x, y, 0);
 }
 
+/**
+ * Creates the ray through the given point based on either perspective or orthographic projections
+ * @param pixel_center the point of the pixel we are shooting through
+ * @return the camera ray
+ */
+ray camera_ray(const vec3& pixel_center) {
+    if (perspective) {
+        return cam.get_ray(pixel_center);
+    }
+    return ray(pixel_center, direction);
+}
+
 /**
  * Shoots a single ray at the given point based on either perspective or orthographic projections
  * @param pixel_center the point of the pixel we are shooting through
+ * @param sampler supplies the random numbers of the sample being traced
  * @return the ray color based on the objects it hits
  */
-color shoot_one_ray(vec3& pixel_center) {
-    ray r;
-    if (perspective) {
-        r = cam.get_ray(pixel_center);
-    } else {
-        r = ray(pixel_center, direction);
+color shoot_one_ray(vec3& pixel_center, sampler& sampler) {
+    return ray_color(camera_ray(pixel_center), sampler);
+}
+
+/**
+ * Shoots one sample of a pixel. The sampler's first 2D sample places the ray within the pixel and the second
+ * is reserved for the lens, which the pinhole camera does not use, so the bounces always start at the same dimension.
+ * @param i, j: the pixel coordinates in the image
+ * @param index: which sample of the pixel this is
+ * @param sampler: supplies the random numbers of the sample
+ * @param offset: where in the pixel to shoot the ray, or NULL to let the sampler choose
+ * @return the color of the sample
+ */
+color shoot_sample(int i, int j, int index, sampler& sampler, const sample_offset* offset) {
+    sampler.start_pixel_sample(i, j, index);
+    sample2 pixel = sampler.get_2d();
+    sampler.get_2d();
+
+    sample_offset position = { (float) pixel.x, (float) pixel.y };
+    if (offset != NULL) {
+        position = *offset;
     }
-    return ray_color(r, max_depth);
+    vec3 sample_center = get_grid_pixel_center(i, j, position);
+    return shoot_one_ray(sample_center, sampler);
 }
 
 /**
- * Shoots multiple rays per pixel, using multi-jittered sampling
+ * Shoots multiple rays per pixel, using one of the precomputed multi-jittered patterns
  * @param i, j: the pixel coordinates in the image
+ * @param sampler: supplies the random numbers of the samples
  * @return the average color for the pixel based of the different rays
  */
-color shoot_multiple_rays(int i, int j) {
-    bool** multi_jitter_mask = get_multi_jitter_mask(fine_grid);
-    vector<color> colors;
-    for (int k = 0; k < fine_grid; k++) {
-        for (int l = 0; l < fine_grid; l++) {
-            if (multi_jitter_mask[k][l]) {
-                vec3 grid_center = get_grid_pixel_center(i, j, k, l);
-                color pixel_color = shoot_one_ray(grid_center);
-                colors.push_back(pixel_color);
+color shoot_multiple_rays(int i, int j, sampler& sampler) {
+    // sample -1 is never traced, so picking the pattern does not reuse any sample's random numbers
+    pcg32 rng = pixel_rng(render_seed, pixel_key(i, j), -1);
+    const vector<sample_offset>& samples = jitter_patterns.pick(rng);
+    color total = color(0, 0, 0);
+    for (int k = 0; k < (int) samples.size(); k++) {
+        total += shoot_sample(i, j, k, sampler, &samples[k]);
+    }
+    return total / samples.size();
+}
+
+/**
+ * Samples a pixel until its estimated error falls below the threshold. Every pixel gets at least
+ * adaptive_min_spp samples, then more in small batches until it is good enough or adaptive_max_spp is spent.
+ * @param i, j: the pixel coordinates in the image
+ * @param sampler: supplies the random numbers of the samples
+ * @param samples: set to the number of samples taken
+ * @return the average color of the samples
+ */
+color shoot_adaptive_rays(int i, int j, sampler& sampler, int& samples) {
+    pixel_estimate estimate;
+    int min_spp = std::min(std::max(2, adaptive_min_spp), adaptive_max_spp);
+    while (estimate.count < min_spp) {
+        estimate.add(shoot_sample(i, j, estimate.count, sampler, NULL));
+    }
+    while (estimate.count < adaptive_max_spp && estimate.relative_error() > adaptive_threshold) {
+        for (int k = 0; k < adaptive_batch && estimate.count < adaptive_max_spp; k++) {
+            estimate.add(shoot_sample(i, j, estimate.count, sampler, NULL));
+        }
+    }
+    samples = estimate.count;
+    return estimate.mean();
+}
+
+/**
+ * Renders a single pixel. With "spp=N" the sampler places N samples within the pixel, otherwise the pixel gets
+ * either multi-jittered samples or one ray through its center. Each sample restarts the sampler from the pixel
+ * and sample index, so the image is the same no matter how many threads render it.
+ * @param i, j: the pixel coordinates in the image
+ * @param sampler: the render thread's sampler
+ * @param samples: set to the number of samples taken
+ * @return the pixel's color
+ */
+color render_pixel(int i, int j, sampler& sampler, int& samples) {
+    if (adaptive) {
+        return shoot_adaptive_rays(i, j, sampler, samples);
+    }
+    if (samples_per_pixel > 0) {
+        color total = color(0, 0, 0);
+        for (int k = 0; k < samples_per_pixel; k++) {
+            total += shoot_sample(i, j, k, sampler, NULL);
+        }
+        samples = samples_per_pixel;
+        return total / samples_per_pixel;
+    }
+    if (jittering) {
+        samples = coarse_grid * coarse_grid;
+        return shoot_multiple_rays(i, j, sampler);
+    }
+    sample_offset center = { 0.5f, 0.5f };
+    samples = 1;
+    return shoot_sample(i, j, 0, sampler, &center);
+}
+
+/**
+ * Renders the whole image into the framebuffer. The image is split into tiles, which are spread over
+ * the render threads with work stealing since some tiles cost far more than others.
+ * @param image: the framebuffer to fill
+ * @param samples: filled with the number of samples each pixel took, in the same order as the image's pixels
+ */
+void render(framebuffer& image, vector<int>& samples) {
+    samples.assign(image.width * image.height, 0);
+    vector<tile> tiles = make_tiles(image.width, image.height, tile_size);
+    vector<sampler*> samplers(thread_count(render_threads));
+    for (int t = 0; t < (int) samplers.size(); t++) {
+        samplers[t] = create_sampler(sampler_name, render_seed);
+    }
+
+    std::atomic<int> tiles_done(0);
+    work_stealing_for(tiles.size(), render_threads, [&](int t, int thread) {
+        scoped_timer timer("tile");
+        const tile& area = tiles[t];
+        for (int j = area.y0; j < area.y1; j++) {
+            for (int i = area.x0; i < area.x1; i++) {
+                image.at(i, j) = render_pixel(i, j, *samplers[thread], samples[j * image.width + i]);
+            }
+        }
+
+        int done = ++tiles_done;
+        if (thread == 0) {
+            cerr << "\rTiles done: " << done << "/" << tiles.size() << ' ' << std::flush;
+        }
+    });
+
+    for (int t = 0; t < (int) samplers.size(); t++) {
+        delete samplers[t];
+    }
+}
+
+/**
+ * Counts the BVH nodes visited and primitives tested by the primary ray through the center of a pixel
+ * @param i, j: the pixel coordinates in the image
+ * @return the number of nodes plus the number of primitive tests
+ */
+double primary_ray_cost(int i, int j) {
+    ray_stats before = thread_ray_stats();
+    hit_record rec;
+    world->closest_hit(camera_ray(get_pixel_center(i, j)), rec, 0.001, infinity);
+    const ray_stats& after = thread_ray_stats();
+    uint64_t primitives_before = before.sphere_tests + before.triangle_tests + before.plane_tests;
+    uint64_t primitives_after = after.sphere_tests + after.triangle_tests + after.plane_tests;
+    return (after.nodes_visited - before.nodes_visited) + (primitives_after - primitives_before);
+}
+
+/**
+ * Renders a false color image of how much work the primary ray of each pixel took, from blue for the cheapest
+ * to red for the most expensive, to show where the tree is bad. The scale runs up to "heatmapmax=N" when given,
+ * so images of different trees can be compared, and up to the most expensive pixel otherwise.
+ * The costs come from the ray statistics, so this needs a build without NO_RAY_STATS.
+ * @param image: the framebuffer to fill
+ * @param samples: filled with one sample for every pixel
+ */
+void render_cost_heatmap(framebuffer& image, vector<int>& samples) {
+#ifdef NO_RAY_STATS
+    cerr << "the traversal cost heatmap needs ray statistics, which were compiled out\n";
+#endif
+    vector<double> costs(image.width * image.height, 0);
+    vector<tile> tiles = make_tiles(image.width, image.height, tile_size);
+    work_stealing_for(tiles.size(), render_threads, [&](int t, int thread) {
+        const tile& area = tiles[t];
+        for (int j = area.y0; j < area.y1; j++) {
+            for (int i = area.x0; i < area.x1; i++) {
+                costs[j * image.width + i] = primary_ray_cost(i, j);
             }
         }
+    });
+
+    double most = *std::max_element(costs.begin(), costs.end());
+    double total = 0;
+    for (int p = 0; p < (int) costs.size(); p++) {
+        total += costs[p];
+    }
+    double scale = heatmap_max_cost > 0 ? heatmap_max_cost : std::max(most, 1.0);
+    for (int p = 0; p < (int) costs.size(); p++) {
+        image.pixels[p] = heatmap_color(costs[p] / scale);
+    }
+    samples.assign(costs.size(), 1);
+    cerr << "primary ray cost: mean " << total / costs.size() << ", max " << most << " nodes and primitives\n";
+}
+
+/**
+ * Writes the image in the output format. 8 bit formats are tonemapped, since the HDR render would otherwise
+ * clip every highlight, while a pfm keeps the linear colors. The cost heatmap is already in display colors.
+ * @param image: the image to write
+ * @param out: the stream to write to, which should be opened in binary mode
+ */
+void write_image(const framebuffer& image, std::ostream& out) {
+    if (output_format == PFM || cost_heatmap) {
+        image.write(out, output_format);
+    } else {
+        image.tonemapped().write(out, output_format);
+    }
+}
+
+/**
+ * Writes the image to a file, going through a temporary file so that a viewer never sees a half written image.
+ * @param image: the image to write
+ * @param filename: the ppm file to replace
+ */
+void write_preview(const framebuffer& image, const string& filename) {
+    string temporary = filename + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    write_image(image, out);
+    out.close();
+    if (!out || rename(temporary.c_str(), filename.c_str()) != 0) {
+        remove(temporary.c_str());
+        cerr << "could not write " << filename << "\n";
+    }
+}
+
+/**
+ * Renders the image in passes of one sample per pixel, adding every pass into a float accumulation buffer.
+ * Every flush_seconds the average so far is written to preview_image, so a long render can be looked at or
+ * stopped early. Rendering stops after "spp=N" passes or when "time=X" seconds have passed, whichever comes first.
+ * Pass k is sample k of every pixel, so N passes give the same image as "spp=N".
+ * @param image: the framebuffer to fill with the final average
+ * @param samples: filled with the number of samples each pixel took, in the same order as the image's pixels
+ */
+void render_progressive(framebuffer& image, vector<int>& samples) {
+    auto start = std::chrono::steady_clock::now();
+    vector<tile> tiles = make_tiles(image.width, image.height, tile_size);
+    vector<sampler*> samplers(thread_count(render_threads));
+    for (int t = 0; t < (int) samplers.size(); t++) {
+        samplers[t] = create_sampler(sampler_name, render_seed);
+    }
+
+    int target = samples_per_pixel;
+    if (target <= 0) {
+        target = progressive_time_limit > 0 ? numeric_limits<int>::max() : progressive_default_spp;
+    }
+
+    accumulation_buffer buffer = accumulation_buffer(image.width, image.height);
+    double last_flush = 0;
+    int pass = 0;
+    while (pass < target) {
+        scoped_timer timer("pass");
+        work_stealing_for(tiles.size(), render_threads, [&](int t, int thread) {
+            const tile& area = tiles[t];
+            for (int j = area.y0; j < area.y1; j++) {
+                for (int i = area.x0; i < area.x1; i++) {
+                    buffer.add(i, j, shoot_sample(i, j, pass, *samplers[thread], NULL));
+                }
+            }
+        });
+        pass++;
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cerr << "\rPasses done: " << pass << ' ' << std::flush;
+        if (progressive_time_limit > 0 && elapsed >= progressive_time_limit) {
+            break;
+        }
+        if (elapsed - last_flush >= flush_seconds && pass < target) {
+            scoped_timer flush_timer("preview flush");
+            buffer.resolve(image);
+            write_preview(image, preview_image);
+            last_flush = elapsed;
+        }
+    }
+
+    buffer.resolve(image);
+    write_preview(image, preview_image);
+    samples = buffer.samples;
+    for (int t = 0; t < (int) samplers.size(); t++) {
+        delete samplers[t];
+    }
+}
+
+/**
+ * Writes a debug image of how many samples each pixel took, from blue for none to red for the most any pixel took
+ * @param image: the rendered image, for its size
+ * @param samples: the samples per pixel, in the image's pixel order
+ * @param filename: the ppm file to write
+ */
+void write_samples_image(const framebuffer& image, const vector<int>& samples, const string& filename) {
+    int most = std::max(1, *std::max_element(samples.begin(), samples.end()));
+    framebuffer heatmap = framebuffer(image.width, image.height);
+    for (int p = 0; p < (int) samples.size(); p++) {
+        heatmap.pixels[p] = heatmap_color((double) samples[p] / most);
+    }
+    std::ofstream out(filename, std::ios::binary);
+    heatmap.write_ppm(out);
+    if (!out) {
+        cerr << "could not write " << filename << "\n";
     }
-    return get_average_color(colors);
 }
 
 /**
@@ -259,6 +657,26 @@ void add_random_spheres() {
     }
 }
 
+/**
+ * Add a LIGHT_GRID x LIGHT_GRID grid of small area lights hanging over the floor, for scenes with many emitters
+ */
+void add_light_grid() {
+    double size = 0.05;
+    double y = 0.6;
+    for (int i = 0; i < LIGHT_GRID; i++) {
+        for (int k = 0; k < LIGHT_GRID; k++) {
+            double x = -4 + 8.0 * (i + 0.5) / LIGHT_GRID;
+            double z = -6 + 6.0 * (k + 0.5) / LIGHT_GRID;
+            vec3 a = vec3(x - size, y, z - size);
+            vec3 b = vec3(x + size, y, z - size);
+            vec3 c = vec3(x + size, y, z + size);
+            vec3 d = vec3(x - size, y, z + size);
+            color emit = ((i + k) % 3 == 0 ? orange : (i + k) % 3 == 1 ? blue : yellow) * 4;
+            objects.push_back(new rectangle(a, b, c, d, white, new area_light(emit)));
+        }
+    }
+}
+
 /**
  * Add area lights to scene
  */
@@ -337,68 +755,289 @@ void generate_checkerboard(double y, color color_a, color color_b) {
 }
 
 /**
- * Create a mesh given the obj file, create the BVH tree for it, and store it in root
+ * Builds the BVH tree over the given objects and converts it into the acceleration structure
+ * picked on the command line. Rays are traced against the flattened tree by default.
+ * @param list: the objects to build the tree for
+ */
+void build_tree(const vector<objs*>& list) {
+    scoped_timer timer("bvh build");
+    root = bvh_node(list, build_options);
+    if (accelerator == "tree") {
+        world = &root;
+    } else if (accelerator == "bvh4") {
+        bvh4_root = wide_bvh<4>(root);
+        world = &bvh4_root;
+    } else if (accelerator == "bvh8") {
+        bvh8_root = wide_bvh<8>(root);
+        world = &bvh8_root;
+    } else {
+        flat_root = linear_bvh(root);
+        world = &flat_root;
+    }
+}
+
+/**
+ * Create a mesh given the obj file, create the BVH tree for it, and store it in root.
+ * With caching on, the mesh and flattened tree are read from the binary cache next to the obj file
+ * when it was written for the same file and build settings, and the cache is rewritten otherwise.
+ * @return false if the obj file could not be loaded, which leaves the scene as it was
  */
-void create_mesh() {
+bool create_mesh() {
     color obj_color = color(1,0,0);
-    mesh obj = mesh("objs/cow.obj", obj_color, new lambertian());
+    string filename = "objs/cow.obj";
+    material* obj_material = new lambertian();
+    bool use_cache = cache_meshes && accelerator == "linear";
+    mesh_cache_key key;
+    if (use_cache) {
+        scoped_timer timer("mesh cache load");
+        key = mesh_cache_key(filename, build_options);
+        if (load_mesh_cache(key, obj_color, obj_material, flat_root) != NULL) {
+            world = &flat_root;
+            cerr << "loaded " << filename << " and its tree from " << key.path << "\n";
+            return true;
+        }
+    }
+
+    timer_clock::time_point load_start = timer_clock::now();
+    mesh obj = mesh(filename, obj_color, obj_material, build_options.threads);
+    global_profiler().record("mesh load", load_start, timer_clock::now(), timer_depth());
+    if (!obj.loaded) {
+        return false;
+    }
     vector<objs*> mesh = obj.get_faces();
-    root = bvh_node(mesh);
+    build_tree(mesh);
+
+    if (use_cache) {
+        scoped_timer timer("mesh cache save");
+        if (!save_mesh_cache(key, *obj.triangles, flat_root)) {
+            cerr << "could not write " << key.path << "\n";
+        }
+    }
+    return true;
 }
 
 /**
- * Checks command line arguments for "p" and "j" to set perspective projection and jittering respectively
+ * Checks command line arguments for "p" and "j" to set perspective projection and jittering respectively.
+ * "sah" builds the BVH with the surface area heuristic instead of the midpoint split, 
+ * and "bins=N" and "leafcost=X" configure the SAH builder.
+ * "tree" traces rays through the pointer based bvh_node instead of the flattened linear_bvh,
+ * and "bvh4" and "bvh8" trace through a 4 or 8 wide BVH with SIMD box tests.
+ * "lbvh" builds the tree from Morton codes instead, with "morton=63" for 63 bit codes, and collapses small subtrees
+ * into leaves by the same "leafcost=X" as the SAH builder,
+ * and "treelets" optimizes the finished tree's topology. "threads=N" sets the number of threads used to load meshes, build the tree and render,
+ * and "tile=N" sets the size of the square tiles the image is rendered in. "seed=N" changes the seed of the render's random numbers.
+ * "sampler=random|sobol|halton|bluenoise" picks where the samples' random numbers come from, and "spp=N" shoots N
+ * samples per pixel placed by that sampler instead of the multi-jittered patterns.
+ * "nonee" turns off next-event estimation, so lights are only found by rays that scatter into them,
+ * and "uniformlights" picks the light to sample uniformly instead of through the light tree.
+ * "adaptive" keeps sampling each pixel until the relative error of its brightness drops below "threshold=X",
+ * taking between "minspp=N" and "maxspp=N" samples, and "sampleimage=FILE" writes a heatmap of the samples each pixel took.
+ * "progressive" renders in passes of one sample per pixel until "spp=N" passes (64 by default) or "time=X" seconds,
+ * writing the image so far to "preview=FILE" (preview.ppm by default) every "flush=X" seconds.
+ * "format=p6|pfm|p3" picks the format of the output image and previews: binary ppm by default, 32 bit float pfm
+ * for the unclamped colors, or the old plain text ppm. Both ppm formats are tonemapped so highlights are not clipped,
+ * and the final image is encoded the same way as the last preview.
+ * "heatmap" renders how many BVH nodes and primitives each pixel's primary ray tested instead of the scene,
+ * with "heatmapmax=N" fixing the cost shown as red.
+ * Ray and traversal counts are printed at the end unless the program is built with -DNO_RAY_STATS.
+ * "trace=FILE" writes the timings of every phase as a Chrome trace event json, next to the summary table printed at the end.
+ * "depth=N" sets the most bounces a path can take, and "rrdepth=N" sets the bounce after which dark paths can be ended at random.
+ * "cache" stores loaded meshes and their flattened tree in a binary file next to the obj file and reuses it on later runs.
  */
 void set_command_line_args(int argc, char* argv[]) {
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
-            if (!string(argv[i]).compare("p")) {
+            string arg = string(argv[i]);
+            if (!arg.compare("p")) {
                 perspective = true;
             }
 
-            if (!string(argv[i]).compare("j")) {
+            if (!arg.compare("j")) {
                 jittering = true;
             }
+
+            if (!arg.compare("tree") || !arg.compare("bvh4") || !arg.compare("bvh8")) {
+                accelerator = arg;
+            }
+
+            if (!arg.compare("sah")) {
+                build_options.method = SAH;
+            }
+
+            if (!arg.compare("lbvh")) {
+                build_options.method = LBVH;
+            }
+
+            if (!arg.compare(0, 7, "morton=")) {
+                build_options.morton_bits = atoi(arg.c_str() + 7);
+            }
+
+            if (!arg.compare("nonee")) {
+                next_event_estimation = false;
+            }
+
+            if (!arg.compare("adaptive")) {
+                adaptive = true;
+            }
+
+            if (!arg.compare(0, 10, "threshold=")) {
+                adaptive_threshold = atof(arg.c_str() + 10);
+            }
+
+            if (!arg.compare(0, 7, "minspp=")) {
+                adaptive_min_spp = atoi(arg.c_str() + 7);
+            }
+
+            if (!arg.compare(0, 7, "maxspp=")) {
+                adaptive_max_spp = std::max(1, atoi(arg.c_str() + 7));
+            }
+
+            if (!arg.compare(0, 12, "sampleimage=")) {
+                samples_image = arg.substr(12);
+            }
+
+            if (!arg.compare("progressive")) {
+                progressive = true;
+            }
+
+            if (!arg.compare(0, 5, "time=")) {
+                progressive_time_limit = atof(arg.c_str() + 5);
+            }
+
+            if (!arg.compare(0, 6, "flush=")) {
+                flush_seconds = atof(arg.c_str() + 6);
+            }
+
+            if (!arg.compare(0, 8, "preview=")) {
+                preview_image = arg.substr(8);
+            }
+
+            if (!arg.compare(0, 7, "format=") && !parse_image_format(arg.substr(7), output_format)) {
+                cerr << "unknown image format " << arg.substr(7) << ", writing a binary ppm\n";
+            }
+
+            if (!arg.compare("heatmap")) {
+                cost_heatmap = true;
+            }
+
+            if (!arg.compare(0, 11, "heatmapmax=")) {
+                heatmap_max_cost = atof(arg.c_str() + 11);
+            }
+
+            if (!arg.compare(0, 6, "trace=")) {
+                trace_file = arg.substr(6);
+            }
+
+            if (!arg.compare(0, 6, "depth=")) {
+                max_depth = std::max(1, atoi(arg.c_str() + 6));
+            }
+
+            if (!arg.compare(0, 8, "rrdepth=")) {
+                roulette_depth = std::max(0, atoi(arg.c_str() + 8));
+            }
+
+            if (!arg.compare("uniformlights")) {
+                light_tree = false;
+            }
+
+            if (!arg.compare("cache")) {
+                cache_meshes = true;
+            }
+
+            if (!arg.compare("treelets")) {
+                build_options.optimize_treelets = true;
+            }
+
+            if (!arg.compare(0, 5, "bins=")) {
+                build_options.bins = atoi(arg.c_str() + 5);
+            }
+
+            if (!arg.compare(0, 9, "leafcost=")) {
+                build_options.leaf_cost = atof(arg.c_str() + 9);
+            }
+
+            if (!arg.compare(0, 8, "threads=")) {
+                build_options.threads = atoi(arg.c_str() + 8);
+                render_threads = build_options.threads;
+            }
+
+            if (!arg.compare(0, 8, "sampler=")) {
+                sampler_name = arg.substr(8);
+            }
+
+            if (!arg.compare(0, 4, "spp=")) {
+                samples_per_pixel = atoi(arg.c_str() + 4);
+            }
+
+            if (!arg.compare(0, 5, "seed=")) {
+                render_seed = strtoull(arg.c_str() + 5, NULL, 10);
+            }
+
+            if (!arg.compare(0, 5, "tile=")) {
+                tile_size = std::max(1, atoi(arg.c_str() + 5));
+            }
         }
     }
 }
 
 // Creates the objects and renders the scene with/without jittering in either perspective or orthographic
 int main(int argc, char* argv[]) {
-    std::clock_t start;
-    double duration;
-    start = std::clock();
+    // the profiler measures every phase from the start of the run
+    profiler& timings = global_profiler();
 
     srand(time(NULL));
     set_command_line_args(argc, argv);
 
-    generate_checkerboard(-0.5, light_gray, dark_gray);
-    add_objects();
-    // add_random_spheres();
-    add_area_lights2();
-    root = bvh_node(objects);
+    {
+        scoped_timer timer("scene setup");
+        if (jittering) {
+            jitter_patterns = jitter_pattern_pool(fine_grid, jitter_pattern_count, render_seed);
+        }
+        generate_checkerboard(-0.5, light_gray, dark_gray);
+        add_objects();
+        // add_random_spheres();
+        add_area_lights2();
+        // add_light_grid();
+    }
+    build_tree(objects);
+    {
+        scoped_timer timer("light tree build");
+        lights = light_list(objects, light_tree);
+    }
 
     // create_mesh();
-    duration = (std::clock() - start) / (double) CLOCKS_PER_SEC;
-    cerr << "\nduration to construct tree is: " << duration << "\n";
-
-    cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    for (int j = image_height - 1; j >=0; j--) {
-        cerr << "\rScanlines done: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            if (jittering) {
-                color average = shoot_multiple_rays(i, j);
-                write_color(cout, average);
-            } else {
-                vec3 pixel_center = get_pixel_center(i, j);
-                color pixel_color = shoot_one_ray(pixel_center);
-                write_color(cout, pixel_color);
-            }
+
+    framebuffer image = framebuffer(image_width, image_height);
+    vector<int> samples;
+    {
+        scoped_timer timer("render");
+        if (cost_heatmap) {
+            render_cost_heatmap(image, samples);
+        } else if (progressive) {
+            render_progressive(image, samples);
+        } else {
+            render(image, samples);
+        }
+    }
+    {
+        scoped_timer timer("output");
+        write_image(image, cout);
+        cout.flush();
+        if (!samples_image.empty()) {
+            write_samples_image(image, samples, samples_image);
         }
     }
 
-    duration = (std::clock() - start) / (double) CLOCKS_PER_SEC;
-    cerr << "\nduration with " << objects.size() << " objects is: " << duration << "\n";
+    long long total_samples = 0;
+    for (int p = 0; p < (int) samples.size(); p++) {
+        total_samples += samples[p];
+    }
+    cerr << "\n\n" << objects.size() << " objects, average samples per pixel: " << (double) total_samples / samples.size() << "\n";
+    timings.print_summary(cerr);
+    print_ray_stats(cerr, total_ray_stats(), timings.total_seconds("render"));
+    if (!trace_file.empty() && !timings.write_trace(trace_file)) {
+        cerr << "could not write " << trace_file << "\n";
+    }
 
     cerr << "\nDone.\n";
 }
\ No newline at end of file
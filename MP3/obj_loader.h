@@ -0,0 +1,465 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "vec3.h"
+#include "parallel.h"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::vector;
+using std::string;
+
+/**
+ * Everything read from an OBJ file. Polygons are triangulated, so every triangle has three entries
+ * in each index list, and a missing texture coordinate or normal is stored as -1.
+ */
+struct obj_data {
+    vector<point3> positions;
+    vector<vec3> normals;
+    vector<vec3> texcoords;
+    vector<int> position_indices;
+    vector<int> texcoord_indices;
+    vector<int> normal_indices;
+};
+
+/**
+ * How long loading a file took, and with how many threads
+ */
+struct obj_load_stats {
+    size_t bytes = 0;
+    int threads = 1;
+    double seconds = 0;
+
+    /** @return the load speed in megabytes per second */
+    double throughput() const {
+        return seconds > 0 ? bytes / 1e6 / seconds : 0;
+    }
+};
+
+/**
+ * A read only memory mapping of a whole file, unmapped when it goes out of scope
+ */
+class mapped_file {
+    public:
+        mapped_file(const string& filename);
+        ~mapped_file();
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool is_open() const {
+            return opened;
+        }
+
+    public:
+        /** the file's bytes, which stay NULL for an empty file since it has nothing to map */
+        const char* data = NULL;
+        size_t size = 0;
+
+    private:
+        bool opened = false;
+};
+
+mapped_file::mapped_file(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        if (info.st_size == 0) {
+            // mmap refuses a zero length mapping, but an empty file is still a file
+            opened = true;
+        } else {
+            void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+                data = (const char*) mapping;
+                size = info.st_size;
+                opened = true;
+            }
+        }
+    }
+    close(fd);
+}
+
+mapped_file::~mapped_file() {
+    if (data != NULL) {
+        munmap((void*) data, size);
+    }
+}
+
+inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+inline void skip_spaces(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+}
+
+/** moves p to the start of the next line */
+inline void skip_line(const char*& p, const char* end) {
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    if (p < end) {
+        p++;
+    }
+}
+
+/**
+ * Parses a signed integer and moves p past it
+ * @return false if there was no integer at p
+ */
+inline bool parse_int(const char*& p, const char* end, int& value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p >= end || !is_digit(*p)) {
+        return false;
+    }
+    int result = 0;
+    while (p < end && is_digit(*p)) {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+/**
+ * Parses a decimal number with an optional exponent, like "-1.5" or "7.88049e-005", and moves p past it.
+ * Digits beyond what fits in 64 bits only change the exponent.
+ * @return false if there was no number at p
+ */
+inline bool parse_double(const char*& p, const char* end, double& value) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool any_digits = false;
+    while (p < end && is_digit(*p)) {
+        if (mantissa < 100000000000000000ULL) {
+            mantissa = mantissa * 10 + (*p - '0');
+        } else {
+            exponent++;
+        }
+        any_digits = true;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p)) {
+            if (mantissa < 100000000000000000ULL) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+            any_digits = true;
+            p++;
+        }
+    }
+    if (!any_digits) {
+        return false;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* exponent_start = p++;
+        int e;
+        if (parse_int(p, end, e)) {
+            exponent += e;
+        } else {
+            p = exponent_start;
+        }
+    }
+
+    double result = (double) mantissa;
+    if (exponent > 0) {
+        result *= exponent <= 22 ? powers[exponent] : pow(10.0, exponent);
+    } else if (exponent < 0) {
+        result /= -exponent <= 22 ? powers[-exponent] : pow(10.0, -exponent);
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+/**
+ * Reads up to three numbers on the rest of the line, leaving missing ones at 0
+ */
+inline vec3 parse_vec3(const char*& p, const char* end) {
+    double v[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3; i++) {
+        skip_spaces(p, end);
+        if (!parse_double(p, end, v[i])) {
+            break;
+        }
+    }
+    return vec3(v[0], v[1], v[2]);
+}
+
+/**
+ * The parsed contents of one chunk of an OBJ file. Negative face indices count back from the last element
+ * defined so far, which a chunk only knows relative to its own first element, so those are resolved
+ * relative to the chunk and the positions they are stored at are remembered to be fixed up later.
+ */
+struct obj_chunk {
+    obj_data data;
+
+    /** for the position, texcoord and normal index lists, where the chunk relative indices are */
+    vector<int> relative[3];
+};
+
+/**
+ * Parses one corner of a face in the v, v/vt, v//vn or v/vt/vn form
+ * @param counts: the number of positions, texcoords and normals defined so far in the chunk
+ * @param index: set to the 0-based position, texcoord and normal index, -1 when missing
+ * @param relative: set to whether each index is relative to the start of the chunk
+ * @return false if the corner has no position index
+ */
+inline bool parse_face_corner(const char*& p, const char* end, const int counts[3], int index[3], bool relative[3]) {
+    for (int i = 0; i < 3; i++) {
+        index[i] = -1;
+        relative[i] = false;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        int value;
+        if (parse_int(p, end, value) && value != 0) {
+            relative[i] = value < 0;
+            index[i] = value > 0 ? value - 1 : counts[i] + value;
+        } else if (i == 0) {
+            return false;
+        }
+        if (i == 2 || p >= end || *p != '/') {
+            break;
+        }
+        p++;
+    }
+
+    // skip anything else attached to the corner
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return true;
+}
+
+/**
+ * Parses the OBJ text between begin and end into chunk. Supports v, vn, vt and f lines, and
+ * triangulates polygons as a fan around their first corner. Every other line is skipped.
+ * Face indices are not checked here, since they can refer to vertices in other chunks.
+ */
+inline void parse_obj(const char* begin, const char* end, obj_chunk& chunk) {
+    obj_data& data = chunk.data;
+    vector<int>* lists[3] = { &data.position_indices, &data.texcoord_indices, &data.normal_indices };
+    vector<int> corners;
+    vector<bool> corner_relative;
+
+    const char* p = begin;
+    while (p < end) {
+        skip_spaces(p, end);
+        if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            data.positions.push_back(parse_vec3(p, end));
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            p += 2;
+            data.normals.push_back(parse_vec3(p, end));
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            p += 2;
+            data.texcoords.push_back(parse_vec3(p, end));
+        } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            int counts[3] = { (int) data.positions.size(), (int) data.texcoords.size(), (int) data.normals.size() };
+            int index[3];
+            bool relative[3];
+            bool valid = true;
+            corners.clear();
+            corner_relative.clear();
+            while (true) {
+                skip_spaces(p, end);
+                if (p >= end || *p == '\r' || *p == '\n' || *p == '#') {
+                    break;
+                }
+                if (!parse_face_corner(p, end, counts, index, relative)) {
+                    valid = false;
+                    break;
+                }
+                for (int i = 0; i < 3; i++) {
+                    corners.push_back(index[i]);
+                    corner_relative.push_back(relative[i]);
+                }
+            }
+
+            // every corner after the second adds a triangle with the first and previous corners
+            int corner_count = corners.size() / 3;
+            for (int c = 2; valid && c < corner_count; c++) {
+                int triangle_corners[3] = { 0, c - 1, c };
+                for (int k = 0; k < 3; k++) {
+                    for (int i = 0; i < 3; i++) {
+                        int slot = 3 * triangle_corners[k] + i;
+                        if (corner_relative[slot]) {
+                            chunk.relative[i].push_back(lists[i]->size());
+                        }
+                        lists[i]->push_back(corners[slot]);
+                    }
+                }
+            }
+        }
+        skip_line(p, end);
+    }
+}
+
+/**
+ * Splits [begin, end) into count pieces that each start at the beginning of a line
+ * @return the count + 1 boundaries of the pieces
+ */
+inline vector<const char*> split_lines(const char* begin, const char* end, int count) {
+    vector<const char*> bounds(count + 1);
+    bounds[0] = begin;
+    bounds[count] = end;
+    for (int i = 1; i < count; i++) {
+        const char* p = std::max(begin + (end - begin) * i / count, bounds[i - 1]);
+        while (p < end && p[-1] != '\n') {
+            p++;
+        }
+        bounds[i] = p;
+    }
+    return bounds;
+}
+
+/**
+ * Merges the parsed chunks into data in file order. Every chunk's relative indices are offset by the
+ * number of elements in the chunks before it, then triangles with a position index that does not exist
+ * are dropped and texcoord or normal indices that do not exist are cleared to -1.
+ * @param threads: the number of threads to merge with
+ */
+inline void merge_obj_chunks(vector<obj_chunk>& chunks, obj_data& data, int threads) {
+    int n = chunks.size();
+    vector<int> bases[3];
+    int totals[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3; i++) {
+        bases[i].resize(n);
+    }
+    for (int c = 0; c < n; c++) {
+        int counts[3] = { (int) chunks[c].data.positions.size(), (int) chunks[c].data.texcoords.size(), (int) chunks[c].data.normals.size() };
+        for (int i = 0; i < 3; i++) {
+            bases[i][c] = totals[i];
+            totals[i] += counts[i];
+        }
+    }
+
+    parallel_for(0, n, threads, [&](int first, int last, int) {
+        for (int c = first; c < last; c++) {
+            obj_data& chunk = chunks[c].data;
+            vector<int>* lists[3] = { &chunk.position_indices, &chunk.texcoord_indices, &chunk.normal_indices };
+            for (int i = 0; i < 3; i++) {
+                for (int r = 0; r < (int) chunks[c].relative[i].size(); r++) {
+                    (*lists[i])[chunks[c].relative[i][r]] += bases[i][c];
+                }
+            }
+
+            // compact the triangles in place, keeping the valid ones
+            int kept = 0;
+            for (int t = 0; t < (int) chunk.position_indices.size(); t += 3) {
+                bool valid = true;
+                for (int k = 0; k < 3; k++) {
+                    int index = chunk.position_indices[t + k];
+                    valid = valid && index >= 0 && index < totals[0];
+                }
+                if (!valid) {
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    for (int i = 0; i < 3; i++) {
+                        int index = (*lists[i])[t + k];
+                        (*lists[i])[kept + k] = (index >= 0 && index < totals[i]) ? index : -1;
+                    }
+                }
+                kept += 3;
+            }
+            for (int i = 0; i < 3; i++) {
+                lists[i]->resize(kept);
+            }
+        }
+    });
+
+    vector<int> index_bases(n);
+    int index_total = 0;
+    for (int c = 0; c < n; c++) {
+        index_bases[c] = index_total;
+        index_total += chunks[c].data.position_indices.size();
+    }
+
+    data.positions.resize(totals[0]);
+    data.texcoords.resize(totals[1]);
+    data.normals.resize(totals[2]);
+    data.position_indices.resize(index_total);
+    data.texcoord_indices.resize(index_total);
+    data.normal_indices.resize(index_total);
+    parallel_for(0, n, threads, [&](int first, int last, int) {
+        for (int c = first; c < last; c++) {
+            const obj_data& chunk = chunks[c].data;
+            std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + bases[0][c]);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), data.texcoords.begin() + bases[1][c]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + bases[2][c]);
+            std::copy(chunk.position_indices.begin(), chunk.position_indices.end(), data.position_indices.begin() + index_bases[c]);
+            std::copy(chunk.texcoord_indices.begin(), chunk.texcoord_indices.end(), data.texcoord_indices.begin() + index_bases[c]);
+            std::copy(chunk.normal_indices.begin(), chunk.normal_indices.end(), data.normal_indices.begin() + index_bases[c]);
+        }
+    });
+}
+
+/** the smallest piece of a file worth giving its own thread */
+const size_t obj_min_chunk_size = 1 << 20;
+
+/**
+ * Loads an OBJ file by memory mapping it and parsing newline aligned chunks of it in parallel
+ * @param filename: the obj file to load
+ * @param data: filled with the file's contents
+ * @param stats: set to the size of the file and how long it took to load
+ * @param threads: the number of threads to parse with, 0 for every core
+ * @return false if the file could not be opened
+ */
+inline bool load_obj(const string& filename, obj_data& data, obj_load_stats& stats, int threads = 0) {
+    auto start = std::chrono::steady_clock::now();
+    mapped_file file(filename);
+    if (!file.is_open()) {
+        std::cerr << "could not open " << filename << "\n";
+        return false;
+    }
+
+    int chunk_count = std::min((size_t) thread_count(threads), std::max(file.size / obj_min_chunk_size, (size_t) 1));
+    vector<const char*> bounds = split_lines(file.data, file.data + file.size, chunk_count);
+    vector<obj_chunk> chunks(chunk_count);
+    parallel_for(0, chunk_count, chunk_count, [&](int first, int last, int) {
+        for (int c = first; c < last; c++) {
+            parse_obj(bounds[c], bounds[c + 1], chunks[c]);
+        }
+    });
+    merge_obj_chunks(chunks, data, chunk_count);
+
+    stats.bytes = file.size;
+    stats.threads = chunk_count;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+#endif
\ No newline at end of file
@@ -3,14 +3,18 @@
 #include "ray.h"
 #include "vec3.h"
 #include "aabb.h"
+#include "light_bounds.h"
 
 #include <vector>
 #include <stdlib.h>
 
 class material;
+class objs;
 
 /**
  * Stores the important information about a ray-object intersection.
+ * During traversal only t, object, u and v are filled in. The rest is computed once
+ * for the closest hit by objs::finalize_hit.
  **/
 struct hit_record {
     /** the point at which the intersection occurs */
@@ -28,6 +32,13 @@ struct hit_record {
     /** the material of the given given */
     material* mat;
 
+    /** the primitive that was hit */
+    const objs* object;
+
+    /** the barycentric coordinates of the hit on a triangle, for the b and c vertices */
+    double u;
+    double v;
+
     /**
      * Determines if the normal faces away from the object and changes it if it doesn't
      * @param r the ray cast at the object
@@ -44,11 +55,44 @@ class objs {
     public:
         /**
          * Determines if there is any intersection between the object and the given ray.
+         * Only rec.t, rec.object and the barycentric coordinates are set, see finalize_hit.
          * @param r the ray that intersects with the object
          * @param rec if the ray intersects, this stores information about how it hit
          * @return true or false depending on if it intersects
          **/
         virtual bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const = 0;
+
+        /**
+         * Fills in the hit point, surface normal, color and material of a hit found by ray_intersection.
+         * This is only called on rec.object once the closest hit is known, so the work is not wasted
+         * on hits that get replaced by a closer one.
+         * @param r the ray that hit the object
+         * @param rec the hit record holding t and the barycentric coordinates
+         **/
+        virtual void finalize_hit(const ray& r, hit_record& rec) const = 0;
+
+        /**
+         * Finds the closest intersection and fully resolves the hit record
+         * @param r the ray to shoot at the object
+         * @param rec if the ray intersects, this stores everything about the closest hit
+         * @return true or false depending on if it intersects
+         **/
+        bool closest_hit(const ray& r, hit_record& rec, double tmin, double tmax) const {
+            if (!ray_intersection(r, rec, tmin, tmax)) {
+                return false;
+            }
+            rec.object->finalize_hit(r, rec);
+            return true;
+        }
+
+        /**
+         * Determines if the ray hits the object anywhere between tmin and tmax. Unlike ray_intersection,
+         * this stops at the first hit it finds and never computes any information about the hit,
+         * so it is much cheaper for shadow rays.
+         * @param r the ray to test
+         * @return true if anything is hit between tmin and tmax
+         **/
+        virtual bool occluded(const ray& r, double tmin, double tmax) const = 0;
         
         /**
          * Calculates the outward surface normal at the given point on the object
@@ -73,6 +117,43 @@ class objs {
          * @return a string saying the type of object it is
          */
         virtual std::string type() const = 0;
+
+        /**
+         * The light given off by the object, which makes it part of the light list when it is not black
+         * @return the emitted color
+         **/
+        virtual color emitted() const {
+            return color(0, 0, 0);
+        }
+
+        /**
+         * Picks a point on the object to send a shadow ray to, for lighting the given point
+         * @param origin the point that is being lit
+         * @param u a random point in the unit square
+         * @return a point on the object's surface
+         **/
+        virtual point3 sample_point(const point3& origin, const sample2& u) const {
+            return origin;
+        }
+
+        /**
+         * The probability density of sample_point choosing the point that a ray from origin hits first, measured per unit solid angle
+         * @param origin the point that is being lit
+         * @param direction the direction of the ray, which does not need to be normalized
+         * @return the density, or 0 if the ray misses the object
+         **/
+        virtual double pdf(const point3& origin, const vec3& direction) const {
+            return 0;
+        }
+
+        /**
+         * Bounds the light the object gives off, for building the light tree. Objects that can not be sampled
+         * as lights give off no power, so they are never picked.
+         * @return the bounds of the emission
+         **/
+        virtual light_bounds emission_bounds() const {
+            return light_bounds(bounding_box(), 0, vec3(0, 0, 1), -1, 0, true);
+        }
 };
 
 #endif
\ No newline at end of file
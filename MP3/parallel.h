@@ -0,0 +1,120 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+/**
+ * Resolves a requested thread count, where anything below 1 means every core
+ * @param threads: the requested number of threads
+ * @return the number of threads to actually use
+ */
+inline int thread_count(int threads) {
+    if (threads > 0) {
+        return threads;
+    }
+    return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+/**
+ * Splits [begin, end) into one contiguous chunk per thread and calls func(chunk_start, chunk_end, thread_index)
+ * for every chunk in parallel. The calling thread runs the first chunk itself.
+ * @param begin, end: the range of indices to process
+ * @param threads: the number of threads to spread the range over, 0 for every core
+ * @param func: the work to do for each chunk
+ */
+template <typename F>
+inline void parallel_for(int begin, int end, int threads, F func) {
+    int count = end - begin;
+    threads = std::min(thread_count(threads), std::max(count, 1));
+    if (threads <= 1) {
+        func(begin, end, 0);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    int chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        int chunk_start = std::min(begin + t * chunk, end);
+        int chunk_end = std::min(chunk_start + chunk, end);
+        workers.push_back(std::thread(func, chunk_start, chunk_end, t));
+    }
+    func(begin, std::min(begin + chunk, end), 0);
+    for (int t = 0; t < (int) workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+/**
+ * A queue of work items that its owner takes from the front and other threads steal from the back
+ */
+struct work_queue {
+    std::mutex lock;
+    std::deque<int> items;
+};
+
+/**
+ * Takes an item from the front of the thread's own queue, or steals one from the back of another queue when it is empty
+ * @param queues: one queue per thread
+ * @param thread: the index of the calling thread
+ * @param item: set to the item that was taken
+ * @return false once every queue is empty
+ */
+inline bool take_work(std::vector<work_queue>& queues, int thread, int& item) {
+    for (int k = 0; k < (int) queues.size(); k++) {
+        int victim = (thread + k) % queues.size();
+        std::lock_guard<std::mutex> guard(queues[victim].lock);
+        std::deque<int>& items = queues[victim].items;
+        if (items.empty()) {
+            continue;
+        }
+        if (k == 0) {
+            item = items.front();
+            items.pop_front();
+        } else {
+            item = items.back();
+            items.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Calls func(item, thread_index) for every item in [0, count) on a pool of threads with work stealing.
+ * The items are dealt out round robin to one queue per thread, and a thread whose queue runs dry steals
+ * from the others, so items that vary a lot in cost still keep every thread busy until the end.
+ * The calling thread works as thread 0.
+ * @param count: the number of items
+ * @param threads: the number of threads to use, 0 for every core
+ * @param func: the work to do for each item
+ */
+template <typename F>
+inline void work_stealing_for(int count, int threads, F func) {
+    threads = std::min(thread_count(threads), std::max(count, 1));
+    std::vector<work_queue> queues(threads);
+    for (int i = 0; i < count; i++) {
+        queues[i % threads].items.push_back(i);
+    }
+
+    auto worker = [&](int thread) {
+        int item;
+        while (take_work(queues, thread, item)) {
+            func(item, thread);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.push_back(std::thread(worker, t));
+    }
+    worker(0);
+    for (int t = 0; t < (int) workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+#endif
@@ -35,6 +35,8 @@ class plane : public objs {
 
         virtual vec3 surface_normal(const point3 position) const;
         virtual bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
         virtual aabb bounding_box() const;
 
     public:
@@ -49,14 +51,28 @@ vec3 plane::surface_normal(const point3 position) const {
 }
 
 bool plane::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    COUNT_RAY_STAT(plane_tests, 1);
     double t = dot((a - r.origin()), unit_vector(n)) / dot(r.direction(), unit_vector(n));
+    if (t < 0.0 || t < tmin || t > tmax) {
+        return false;
+    }
 
     rec.t = t;
-    rec.p = r.at(t);
+    rec.object = this;
+    return true;
+}
+
+void plane::finalize_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
     rec.set_normal(r, unit_vector(n));
     rec.kD = kD;
     rec.mat = m;
-    return (t >= 0.0);
+}
+
+bool plane::occluded(const ray& r, double tmin, double tmax) const {
+    COUNT_RAY_STAT(plane_tests, 1);
+    double t = dot((a - r.origin()), unit_vector(n)) / dot(r.direction(), unit_vector(n));
+    return t >= 0.0 && t >= tmin && t <= tmax;
 }
 
 aabb plane::bounding_box() const {
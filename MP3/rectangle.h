@@ -7,6 +7,8 @@
 #include "aabb.h"
 #include "material.h"
 #include "triangle.h"
+#include "color.h"
+#include <limits>
 
 class rectangle : public objs {
     public: 
@@ -15,7 +17,7 @@ class rectangle : public objs {
          * @param a_t, b_t, c_t: the three edge points of the triangle
          * @param kDiffuse the kDiffuse element for the Phong shading model
          */
-        rectangle(const vec3& a, const vec3& b, const vec3& c, const vec3& d, const color& kDiffuse, material* mat) : kD(kDiffuse), m(mat) {
+        rectangle(const vec3& a, const vec3& b, const vec3& c, const vec3& d, const color& kDiffuse, material* mat) : a(a), b(b), c(c), d(d), kD(kDiffuse), m(mat) {
             t1 = new triangle(a, b, c, kDiffuse, mat);
             t2 = new triangle(a, c, d, kDiffuse, mat);
             bbox = create_aabb();
@@ -37,9 +39,27 @@ class rectangle : public objs {
             return "rectangle";
         }
 
+        color emitted() const {
+            return m->emitted();
+        }
+
+        double area() const {
+            return cross(b - a, d - a).length();
+        }
+
+        /** the rectangle emits from both faces, into the hemisphere around each */
+        light_bounds emission_bounds() const {
+            double power = luminance(emitted()) * area() * M_PI * 2;
+            return light_bounds(bbox, power, cross(b - a, d - a), 1, 0, true);
+        }
+
         // virtual color kDiffuse() const;
         vec3 surface_normal(const point3 position) const;
         bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        bool occluded(const ray& r, double tmin, double tmax) const;
+        void finalize_hit(const ray& r, hit_record& rec) const;
+        point3 sample_point(const point3& origin, const sample2& u) const;
+        double pdf(const point3& origin, const vec3& direction) const;
         aabb create_aabb() const;
 
     public:
@@ -57,8 +77,47 @@ vec3 rectangle::surface_normal(const point3 position) const {
 
 bool rectangle::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
     bool t1_intersect = t1->ray_intersection(r, rec, tmin, tmax);
-    bool t2_intersect = t2->ray_intersection(r, rec, tmin, tmax);
-    return t1_intersect || t2_intersect;
+    bool t2_intersect = t2->ray_intersection(r, rec, tmin, t1_intersect ? rec.t : tmax);
+    if (t1_intersect || t2_intersect) {
+        rec.object = this;
+        return true;
+    }
+    return false;
+}
+
+/** 
+ * Hits are recorded against the rectangle, so a light that is hit can be looked up in the light list.
+ * Both triangles share the same normal and material, so either one can finish the hit.
+ */
+void rectangle::finalize_hit(const ray& r, hit_record& rec) const {
+    t1->finalize_hit(r, rec);
+}
+
+bool rectangle::occluded(const ray& r, double tmin, double tmax) const {
+    return t1->occluded(r, tmin, tmax) || t2->occluded(r, tmin, tmax);
+}
+
+/**
+ * Picks a point uniformly over the area of the rectangle. The origin does not change the choice.
+ */
+point3 rectangle::sample_point(const point3& origin, const sample2& u) const {
+    return a + u.x * (b - a) + u.y * (d - a);
+}
+
+/**
+ * Converts the uniform density over the area, 1 / area, into a density per solid angle as seen from origin
+ */
+double rectangle::pdf(const point3& origin, const vec3& direction) const {
+    ray r = ray(origin, unit_vector(direction));
+    hit_record rec;
+    if (!ray_intersection(r, rec, 0.001, std::numeric_limits<double>::infinity())) {
+        return 0;
+    }
+    double cosine = fabs(dot(t1->surface_normal(origin), r.direction()));
+    if (cosine <= 0) {
+        return 0;
+    }
+    return rec.t * rec.t / (cosine * area());
 }
 
 aabb rectangle::create_aabb() const {
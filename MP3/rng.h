@@ -0,0 +1,104 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+/**
+ * PCG32 random number generator (O'Neill 2014). It is small enough to keep one per thread, or even one per pixel,
+ * and every stream gives an independent sequence for the same seed.
+ */
+class pcg32 {
+    public:
+        pcg32() {
+            seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL);
+        }
+
+        pcg32(uint64_t initial_state, uint64_t stream) {
+            seed(initial_state, stream);
+        }
+
+        void seed(uint64_t initial_state, uint64_t stream);
+        uint32_t next_uint();
+        uint32_t next_uint(uint32_t bound);
+        double next_double();
+
+    private:
+        uint64_t state;
+        uint64_t increment;
+};
+
+/**
+ * Restarts the generator
+ * @param initial_state: the starting point of the sequence
+ * @param stream: which of the 2^63 sequences to use
+ */
+inline void pcg32::seed(uint64_t initial_state, uint64_t stream) {
+    state = 0;
+    increment = (stream << 1) | 1;
+    next_uint();
+    state += initial_state;
+    next_uint();
+}
+
+/**
+ * @return a uniformly distributed 32 bit number
+ */
+inline uint32_t pcg32::next_uint() {
+    uint64_t old_state = state;
+    state = old_state * 6364136223846793005ULL + increment;
+    uint32_t xorshifted = (uint32_t) (((old_state >> 18) ^ old_state) >> 27);
+    uint32_t rotation = (uint32_t) (old_state >> 59);
+    return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+}
+
+/**
+ * @return a uniformly distributed number in [0, bound), without the bias of taking the remainder
+ */
+inline uint32_t pcg32::next_uint(uint32_t bound) {
+    uint32_t threshold = (-bound) % bound;
+    while (true) {
+        uint32_t r = next_uint();
+        if (r >= threshold) {
+            return r % bound;
+        }
+    }
+}
+
+/**
+ * @return a uniformly distributed double in [0, 1)
+ */
+inline double pcg32::next_double() {
+    return next_uint() * (1.0 / 4294967296.0);
+}
+
+/**
+ * Finalizer of splitmix64, which scrambles every bit of x into every bit of the result
+ */
+inline uint64_t mix_bits(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @return a number that identifies the pixel (i, j) in an image of any size
+ */
+inline uint64_t pixel_key(int i, int j) {
+    return ((uint64_t) (uint32_t) j << 32) | (uint32_t) i;
+}
+
+/**
+ * Creates the generator for one sample of one pixel. Every pixel gets its own stream, so the image only
+ * depends on the seed and never on which thread rendered which pixel.
+ * @param seed: the seed of the whole render
+ * @param pixel: the pixel_key of the pixel
+ * @param sample: the index of the sample, for renders that revisit a pixel
+ */
+inline pcg32 pixel_rng(uint64_t seed, uint64_t pixel, int sample) {
+    return pcg32(mix_bits(seed ^ mix_bits((uint64_t) sample + 1)), pixel);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,452 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+#include "vec3.h"
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+
+/**
+ * The random numbers used at one bounce: a 2D sample for the new direction and a 1D sample for choices such as
+ * reflecting or refracting, so every material uses the same dimensions of the sampler, followed by a 1D sample
+ * to pick a light, a 2D sample to pick a point on it, and a 1D sample for deciding whether the path ends
+ */
+struct bounce_sample {
+    sample2 direction;
+    double lobe;
+    double light;
+    sample2 light_point;
+    double roulette;
+};
+
+/**
+ * Supplies the random numbers for the samples of each pixel. A sample asks for its dimensions in a fixed order:
+ * a 2D sample for the position in the pixel, a 2D sample for the lens, and then the dimensions of a bounce_sample for every bounce.
+ * Each call to get_1d or get_2d moves on to the next dimension. A sampler keeps state, so each render thread needs its own.
+ */
+class sampler {
+    public:
+        sampler(uint64_t s) : seed(s) {}
+        virtual ~sampler() {}
+
+        /**
+         * Moves to the first dimension of a new sample
+         * @param i, j: the pixel coordinates in the image
+         * @param index: which sample of the pixel this is
+         */
+        virtual void start_pixel_sample(int i, int j, int index) {
+            pixel_x = i;
+            pixel_y = j;
+            sample_index = index;
+            dimension = 0;
+            pixel_seed = mix_bits(seed ^ mix_bits(pixel_key(i, j)));
+        }
+
+        virtual double get_1d() = 0;
+        virtual sample2 get_2d() = 0;
+
+        bounce_sample get_bounce() {
+            bounce_sample u;
+            u.direction = get_2d();
+            u.lobe = get_1d();
+            u.light = get_1d();
+            u.light_point = get_2d();
+            u.roulette = get_1d();
+            return u;
+        }
+
+    protected:
+        uint64_t seed;
+        uint64_t pixel_seed = 0;
+        int pixel_x = 0;
+        int pixel_y = 0;
+        int sample_index = 0;
+        int dimension = 0;
+};
+
+/** @return a double in [0, 1) from the top bits of a hash */
+inline double hash_to_unit(uint64_t hash) {
+    return (hash >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Independent uniform random numbers from a PCG32 generator seeded for each pixel and sample
+ */
+class random_sampler : public sampler {
+    public:
+        random_sampler(uint64_t s) : sampler(s) {}
+
+        void start_pixel_sample(int i, int j, int index) override {
+            sampler::start_pixel_sample(i, j, index);
+            rng = pixel_rng(seed, pixel_key(i, j), index);
+        }
+
+        double get_1d() override {
+            dimension++;
+            return rng.next_double();
+        }
+
+        sample2 get_2d() override {
+            dimension += 2;
+            double x = rng.next_double();
+            return { x, rng.next_double() };
+        }
+
+    private:
+        pcg32 rng;
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/**
+ * The second dimension of the Sobol sequence. The first is reverse_bits(index).
+ */
+inline uint32_t sobol_second_dimension(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+/**
+ * Hash based Owen scrambling of a 32 bit fixed point number (Burley 2020). Every bit is flipped depending on
+ * the bits above it, which randomizes the points while keeping the sequence's stratification.
+ */
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+/**
+ * Owen scrambled Sobol points. Every dimension reuses the first two Sobol dimensions, and the sample index
+ * is shuffled separately for each of them, so each 2D pair is well stratified and the pairs are uncorrelated.
+ */
+class sobol_sampler : public sampler {
+    public:
+        sobol_sampler(uint64_t s) : sampler(s) {}
+
+        double get_1d() override {
+            uint32_t index = shuffled_index();
+            uint32_t x = nested_uniform_scramble(reverse_bits(index), (uint32_t) mix_bits(pixel_seed ^ (2 * dimension + 1)));
+            dimension++;
+            return x * (1.0 / 4294967296.0);
+        }
+
+        sample2 get_2d() override {
+            uint32_t index = shuffled_index();
+            uint32_t x = nested_uniform_scramble(reverse_bits(index), (uint32_t) mix_bits(pixel_seed ^ (2 * dimension + 1)));
+            uint32_t y = nested_uniform_scramble(sobol_second_dimension(index), (uint32_t) mix_bits(pixel_seed ^ (2 * dimension + 2)));
+            dimension += 2;
+            return { x * (1.0 / 4294967296.0), y * (1.0 / 4294967296.0) };
+        }
+
+    private:
+        uint32_t shuffled_index() const {
+            return nested_uniform_scramble(sample_index, (uint32_t) (mix_bits(pixel_seed + dimension) >> 32));
+        }
+};
+
+/** the bases of the Halton sequence's dimensions */
+const int halton_primes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                              59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131 };
+const int halton_dimensions = sizeof(halton_primes) / sizeof(halton_primes[0]);
+
+/**
+ * @return the digits of index in the given base, mirrored around the decimal point
+ */
+inline double radical_inverse(int base, uint32_t index) {
+    double inverse_base = 1.0 / base;
+    double factor = inverse_base;
+    double result = 0;
+    while (index > 0) {
+        result += (index % base) * factor;
+        index /= base;
+        factor *= inverse_base;
+    }
+    return result;
+}
+
+/**
+ * The radical inverse with the digits at each position passed through a random permutation of [0, base)
+ * (random digit scrambling). Different dimensions get unrelated permutations, which breaks up the
+ * correlation between the Halton dimensions with large bases.
+ * @param hash: picks the permutation of each digit position
+ */
+inline double scrambled_radical_inverse(int base, uint32_t index, uint64_t hash) {
+    int permutation[256];
+    double inverse_base = 1.0 / base;
+    double factor = inverse_base;
+    double result = 0;
+    int level = 0;
+    for (; index > 0; level++) {
+        pcg32 rng = pcg32(hash, level);
+        for (int d = 0; d < base; d++) {
+            permutation[d] = d;
+        }
+        for (int d = base - 1; d > 0; d--) {
+            std::swap(permutation[d], permutation[rng.next_uint(d + 1)]);
+        }
+        result += permutation[index % base] * factor;
+        index /= base;
+        factor *= inverse_base;
+    }
+
+    // the remaining digits of index are all 0, which the permutations turn into random digits
+    return result + factor * base * hash_to_unit(mix_bits(hash ^ ((uint64_t) level << 48)));
+}
+
+/**
+ * Halton points, randomized for each pixel by scrambling the digits of every dimension.
+ * Dimensions past the last prime fall back to independent random numbers.
+ */
+class halton_sampler : public sampler {
+    public:
+        halton_sampler(uint64_t s) : sampler(s) {}
+
+        double get_1d() override {
+            return next_dimension();
+        }
+
+        sample2 get_2d() override {
+            double x = next_dimension();
+            return { x, next_dimension() };
+        }
+
+    private:
+        double next_dimension() {
+            uint64_t hash = mix_bits(pixel_seed ^ ((uint64_t) dimension << 32));
+            double value;
+            if (dimension < halton_dimensions) {
+                value = scrambled_radical_inverse(halton_primes[dimension], sample_index, hash);
+            } else {
+                value = hash_to_unit(mix_bits(hash ^ sample_index));
+            }
+            dimension++;
+            return fmin(value, 0.99999999999999989);
+        }
+};
+
+/** the width and height of the blue noise tile */
+const int blue_noise_size = 64;
+
+/**
+ * A tileable blue noise texture with one threshold in [0, 1) per texel, made with the void and cluster method
+ * (Ulichney 1993). Neighbouring texels have very different values, so using them to offset the samples of
+ * neighbouring pixels pushes the error into high frequencies, where it looks like fine grain instead of blotches.
+ */
+class blue_noise_mask {
+    public:
+        blue_noise_mask();
+
+        double value(int x, int y) const {
+            x = ((x % blue_noise_size) + blue_noise_size) % blue_noise_size;
+            y = ((y % blue_noise_size) + blue_noise_size) % blue_noise_size;
+            return values[y * blue_noise_size + x];
+        }
+
+    private:
+        void update_energy(vector<double>& energy, int index, double sign) const;
+
+    public:
+        vector<double> values;
+
+    private:
+        /** the gaussian weight for every wrapped distance (dx, dy) between two texels */
+        vector<double> kernel;
+};
+
+/**
+ * Adds or removes the gaussian splat of one texel from the energy of every texel, wrapping around the edges
+ */
+void blue_noise_mask::update_energy(vector<double>& energy, int index, double sign) const {
+    const int half = blue_noise_size / 2 + 1;
+    int px = index % blue_noise_size;
+    int py = index / blue_noise_size;
+    for (int y = 0; y < blue_noise_size; y++) {
+        int dy = abs(y - py);
+        dy = std::min(dy, blue_noise_size - dy);
+        for (int x = 0; x < blue_noise_size; x++) {
+            int dx = abs(x - px);
+            dx = std::min(dx, blue_noise_size - dx);
+            energy[y * blue_noise_size + x] += sign * kernel[dy * half + dx];
+        }
+    }
+}
+
+blue_noise_mask::blue_noise_mask() {
+    const int n = blue_noise_size * blue_noise_size;
+    const int half = blue_noise_size / 2 + 1;
+    const double sigma = 1.5;
+    kernel.resize(half * half);
+    for (int dy = 0; dy < half; dy++) {
+        for (int dx = 0; dx < half; dx++) {
+            kernel[dy * half + dx] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    vector<bool> pattern(n, false);
+    vector<double> energy(n, 0.0);
+    vector<int> rank(n, 0);
+    pcg32 rng = pcg32(0x9e3779b97f4a7c15ULL, 1);
+
+    // the tightest cluster is the set texel with the most energy, and the largest void the empty one with the least
+    auto tightest_cluster = [&](const vector<bool>& set) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (set[i] && (best < 0 || energy[i] > energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    };
+    auto largest_void = [&](const vector<bool>& set) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (!set[i] && (best < 0 || energy[i] < energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    // start with a random tenth of the texels set, then spread them out evenly
+    int ones = n / 10;
+    for (int placed = 0; placed < ones;) {
+        int i = rng.next_uint(n);
+        if (!pattern[i]) {
+            pattern[i] = true;
+            update_energy(energy, i, 1);
+            placed++;
+        }
+    }
+    while (true) {
+        int cluster = tightest_cluster(pattern);
+        pattern[cluster] = false;
+        update_energy(energy, cluster, -1);
+        int empty = largest_void(pattern);
+        if (empty == cluster) {
+            pattern[cluster] = true;
+            update_energy(energy, cluster, 1);
+            break;
+        }
+        pattern[empty] = true;
+        update_energy(energy, empty, 1);
+    }
+    vector<bool> initial = pattern;
+    vector<double> initial_energy = energy;
+
+    // rank the initial texels by removing the tightest clusters first
+    for (int r = ones - 1; r >= 0; r--) {
+        int cluster = tightest_cluster(pattern);
+        pattern[cluster] = false;
+        update_energy(energy, cluster, -1);
+        rank[cluster] = r;
+    }
+
+    // then rank the rest by filling the largest voids
+    pattern = initial;
+    energy = initial_energy;
+    for (int r = ones; r < n; r++) {
+        int empty = largest_void(pattern);
+        pattern[empty] = true;
+        update_energy(energy, empty, 1);
+        rank[empty] = r;
+    }
+
+    values.resize(n);
+    for (int i = 0; i < n; i++) {
+        values[i] = (rank[i] + 0.5) / n;
+    }
+}
+
+/**
+ * @return the blue noise texture, generated the first time it is needed
+ */
+inline const blue_noise_mask& shared_blue_noise() {
+    static const blue_noise_mask mask;
+    return mask;
+}
+
+/**
+ * Sobol points that are the same for every pixel, shifted per pixel and dimension by a blue noise texture
+ * (Georgiev and Fajardo 2016). Each dimension reads the texture at a different offset so the dimensions stay independent.
+ */
+class blue_noise_sampler : public sampler {
+    public:
+        blue_noise_sampler(uint64_t s) : sampler(s), mask(shared_blue_noise()) {}
+
+        double get_1d() override {
+            uint32_t index = shuffled_index();
+            double x = shift(reverse_bits(index) * (1.0 / 4294967296.0), 2 * dimension);
+            dimension++;
+            return x;
+        }
+
+        sample2 get_2d() override {
+            uint32_t index = shuffled_index();
+            double x = shift(reverse_bits(index) * (1.0 / 4294967296.0), 2 * dimension);
+            double y = shift(sobol_second_dimension(index) * (1.0 / 4294967296.0), 2 * dimension + 1);
+            dimension += 2;
+            return { x, y };
+        }
+
+    private:
+        /** the same shuffle for every pixel, so neighbouring pixels only differ by the blue noise shift */
+        uint32_t shuffled_index() const {
+            return nested_uniform_scramble(sample_index, (uint32_t) (mix_bits(seed + dimension) >> 32));
+        }
+
+        double shift(double value, int channel) const {
+            uint64_t hash = mix_bits(seed ^ ((uint64_t) channel << 40));
+            int offset_x = hash % blue_noise_size;
+            int offset_y = (hash >> 16) % blue_noise_size;
+            value += mask.value(pixel_x + offset_x, pixel_y + offset_y);
+            value -= floor(value);
+            return fmin(value, 0.99999999999999989);
+        }
+
+    private:
+        const blue_noise_mask& mask;
+};
+
+/**
+ * Creates a sampler by name
+ * @param name: "random", "sobol", "halton" or "bluenoise"
+ * @param seed: the seed of the render
+ * @return the new sampler, or a random sampler if the name is not known
+ */
+inline sampler* create_sampler(const string& name, uint64_t seed) {
+    if (name == "sobol") {
+        return new sobol_sampler(seed);
+    }
+    if (name == "halton") {
+        return new halton_sampler(seed);
+    }
+    if (name == "bluenoise") {
+        return new blue_noise_sampler(seed);
+    }
+    return new random_sampler(seed);
+}
+
+#endif
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include "ray.h"
 #include "aabb.h"
 #include "material.h"
+#include "utils.h"
+#include "color.h"
+#include <limits>
 
 using std::sqrt;
 
@@ -44,9 +47,24 @@ class sphere : public objs {
             return "sphere";
         }
 
+        color emitted() const {
+            return m->emitted();
+        }
+
+        /** the sphere's normals point every way, and each emits into the hemisphere around it */
+        light_bounds emission_bounds() const {
+            double power = luminance(emitted()) * 4 * M_PI * rad * rad * M_PI;
+            return light_bounds(bbox, power, vec3(0, 0, 1), -1, 0, false);
+        }
+
         // virtual color kDiffuse() const;
         virtual vec3 surface_normal(const point3 position) const;
         virtual bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+        virtual void finalize_hit(const ray& r, hit_record& rec) const;
+        virtual point3 sample_point(const point3& origin, const sample2& u) const;
+        virtual double pdf(const point3& origin, const vec3& direction) const;
+        bool hit_distance(const ray& r, double tmin, double tmax, double& root) const;
         aabb create_aabb() const;
 
     public:
@@ -61,13 +79,17 @@ vec3 sphere::surface_normal(const point3 position) const {
     return unit_vector(position - c);
 }
 
-bool sphere::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+/**
+ * Solves for the closest point where the ray enters or leaves the sphere within [tmin, tmax]
+ * @param root: set to the distance along the ray if it hits
+ * @return true if the ray hits the sphere between tmin and tmax
+ */
+bool sphere::hit_distance(const ray& r, double tmin, double tmax, double& root) const {
     vec3 oc = r.origin() - c;
     double a = r.direction().length_squared();
     double half_b = dot(oc, r.direction());
     double c = oc.length_squared() - rad * rad;
     double discriminant = half_b * half_b - a * c;
-    double root;
     if (discriminant < 0) {
         return false; // no intersection
     } 
@@ -79,13 +101,86 @@ bool sphere::ray_intersection(const ray& r, hit_record& rec, double tmin, double
             return false;
         }
     }
+    return true;
+}
+
+bool sphere::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    COUNT_RAY_STAT(sphere_tests, 1);
+    double root;
+    if (!hit_distance(r, tmin, tmax, root)) {
+        return false;
+    }
 
     rec.t = root;
-    rec.p = r.at(root);
-    rec.set_normal(r, surface_normal(rec.p));
+    rec.object = this;
+    return true;
+}
+
+void sphere::finalize_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.set_normal(r, (rec.p - c) / rad);
     rec.kD = kD;
     rec.mat = m;
-    return true;
+}
+
+bool sphere::occluded(const ray& r, double tmin, double tmax) const {
+    COUNT_RAY_STAT(sphere_tests, 1);
+    double root;
+    return hit_distance(r, tmin, tmax, root);
+}
+
+/**
+ * Picks a point on the part of the sphere that is visible from origin, by choosing a direction uniformly within
+ * the cone of directions that hit the sphere. From inside the sphere every point is visible, so the direction
+ * is chosen uniformly over the whole sphere instead.
+ */
+point3 sphere::sample_point(const point3& origin, const sample2& u) const {
+    vec3 to_center = c - origin;
+    double distance_squared = to_center.length_squared();
+    if (distance_squared <= rad * rad) {
+        ray r = ray(origin, uniform_sphere(u.x, u.y));
+        double root;
+        hit_distance(r, 0, std::numeric_limits<double>::infinity(), root);
+        return r.at(root);
+    }
+
+    // build a frame around the direction to the center and pick a direction inside the cone
+    vec3 w = unit_vector(to_center);
+    vec3 helper = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 v = unit_vector(cross(w, helper));
+    vec3 s = cross(w, v);
+    double cos_max = sqrt(fmax(0.0, 1 - rad * rad / distance_squared));
+    double cos_theta = 1 - u.x * (1 - cos_max);
+    double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+    double phi = 2 * M_PI * u.y;
+    vec3 direction = cos(phi) * sin_theta * s + sin(phi) * sin_theta * v + cos_theta * w;
+
+    ray r = ray(origin, direction);
+    double root;
+    if (!hit_distance(r, 0, std::numeric_limits<double>::infinity(), root)) {
+        // only directions grazing the edge of the cone miss, so use the closest point along the ray
+        root = dot(to_center, direction);
+    }
+    return r.at(root);
+}
+
+/**
+ * The density of sample_point's choice: uniform over the cone's solid angle from outside,
+ * or uniform over every direction from inside
+ */
+double sphere::pdf(const point3& origin, const vec3& direction) const {
+    ray r = ray(origin, unit_vector(direction));
+    double root;
+    if (!hit_distance(r, 0.001, std::numeric_limits<double>::infinity(), root)) {
+        return 0;
+    }
+
+    double distance_squared = (c - origin).length_squared();
+    if (distance_squared <= rad * rad) {
+        return 1 / (4 * M_PI);
+    }
+    double cos_max = sqrt(fmax(0.0, 1 - rad * rad / distance_squared));
+    return 1 / (2 * M_PI * (1 - cos_max));
 }
 
 aabb sphere::create_aabb() const {
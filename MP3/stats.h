@@ -0,0 +1,124 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <iostream>
+
+/**
+ * Counts of the work done while tracing rays. Every thread counts into its own copy, which is added
+ * to the totals when the thread ends, so counting never needs a lock or an atomic.
+ * Building with -DNO_RAY_STATS compiles every count out.
+ */
+struct ray_stats {
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t shadow_rays = 0;
+    uint64_t nodes_visited = 0;
+    uint64_t box_tests = 0;
+    uint64_t sphere_tests = 0;
+    uint64_t triangle_tests = 0;
+    uint64_t plane_tests = 0;
+
+    void merge(const ray_stats& other);
+};
+
+/**
+ * Adds another set of counts to these
+ */
+inline void ray_stats::merge(const ray_stats& other) {
+    primary_rays += other.primary_rays;
+    secondary_rays += other.secondary_rays;
+    shadow_rays += other.shadow_rays;
+    nodes_visited += other.nodes_visited;
+    box_tests += other.box_tests;
+    sphere_tests += other.sphere_tests;
+    triangle_tests += other.triangle_tests;
+    plane_tests += other.plane_tests;
+}
+
+/** @return the counts of every thread that has finished */
+inline ray_stats& finished_ray_stats() {
+    static ray_stats finished;
+    return finished;
+}
+
+/** @return the lock guarding finished_ray_stats */
+inline std::mutex& finished_ray_stats_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+/**
+ * A thread's own counts, which are added to the finished totals when the thread exits
+ */
+struct thread_ray_stats_slot {
+    ray_stats counts;
+
+    ~thread_ray_stats_slot() {
+        std::lock_guard<std::mutex> guard(finished_ray_stats_lock());
+        finished_ray_stats().merge(counts);
+    }
+};
+
+/** @return the calling thread's counts */
+inline ray_stats& thread_ray_stats() {
+    thread_local thread_ray_stats_slot slot;
+    return slot.counts;
+}
+
+#ifdef NO_RAY_STATS
+#define COUNT_RAY_STAT(field, amount) ((void) 0)
+#else
+#define COUNT_RAY_STAT(field, amount) (thread_ray_stats().field += (amount))
+#endif
+
+/**
+ * @return the counts of every finished thread plus the calling thread's own
+ */
+inline ray_stats total_ray_stats() {
+    std::lock_guard<std::mutex> guard(finished_ray_stats_lock());
+    ray_stats total = finished_ray_stats();
+    total.merge(thread_ray_stats());
+    return total;
+}
+
+/**
+ * Prints the totals, the rays traced per second of rendering, and the derived averages
+ * @param stats: the counts to print
+ * @param render_seconds: the wall-clock time spent rendering
+ */
+inline void print_ray_stats(std::ostream& out, const ray_stats& stats, double render_seconds) {
+#ifdef NO_RAY_STATS
+    out << "\nray statistics were compiled out\n";
+#else
+    uint64_t camera_path_rays = stats.primary_rays + stats.secondary_rays;
+    uint64_t rays = camera_path_rays + stats.shadow_rays;
+    char line[128];
+    out << "\n";
+    const char* names[8] = { "primary rays", "secondary rays", "shadow rays", "bvh nodes visited",
+                             "box tests", "sphere tests", "triangle tests", "plane tests" };
+    uint64_t values[8] = { stats.primary_rays, stats.secondary_rays, stats.shadow_rays, stats.nodes_visited,
+                           stats.box_tests, stats.sphere_tests, stats.triangle_tests, stats.plane_tests };
+    for (int k = 0; k < 8; k++) {
+        snprintf(line, sizeof(line), "%-28s %16llu\n", names[k], (unsigned long long) values[k]);
+        out << line;
+    }
+    if (rays > 0) {
+        snprintf(line, sizeof(line), "%-28s %16.2f\n", "Mrays/s", render_seconds > 0 ? rays / render_seconds / 1e6 : 0.0);
+        out << line;
+        snprintf(line, sizeof(line), "%-28s %16.2f\n", "nodes per ray", (double) stats.nodes_visited / rays);
+        out << line;
+        snprintf(line, sizeof(line), "%-28s %16.2f\n", "primitive tests per ray",
+                 (double) (stats.sphere_tests + stats.triangle_tests + stats.plane_tests) / rays);
+        out << line;
+    }
+    if (stats.primary_rays > 0) {
+        snprintf(line, sizeof(line), "%-28s %16.2f\n", "average path length", (double) camera_path_rays / stats.primary_rays);
+        out << line;
+    }
+#endif
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,191 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+
+typedef std::chrono::steady_clock timer_clock;
+
+/**
+ * One finished timing: what was timed, when it started relative to the start of the program,
+ * how long it took, and on which thread
+ */
+struct timer_event {
+    string name;
+    double start;
+    double seconds;
+    int thread;
+    int depth;
+};
+
+/**
+ * Collects the wall-clock times of the phases of a run. Timers on any thread can record into it.
+ */
+class profiler {
+    public:
+        profiler() : origin(timer_clock::now()) {}
+
+        void record(const string& name, timer_clock::time_point start, timer_clock::time_point end, int depth);
+        double total_seconds(const string& name) const;
+        void print_summary(std::ostream& out) const;
+        bool write_trace(const string& filename) const;
+
+    public:
+        timer_clock::time_point origin;
+        vector<timer_event> events;
+        mutable std::mutex lock;
+};
+
+/** @return the profiler that every timer records into by default */
+inline profiler& global_profiler() {
+    static profiler instance;
+    return instance;
+}
+
+/** @return a small number identifying the calling thread, in the order threads first asked */
+inline int timer_thread_id() {
+    static std::atomic<int> next_id(0);
+    thread_local int id = next_id++;
+    return id;
+}
+
+/** @return how deeply the calling thread's running timers are nested */
+inline int& timer_depth() {
+    thread_local int depth = 0;
+    return depth;
+}
+
+/**
+ * Times the scope it lives in and records it into the profiler when the scope ends
+ */
+class scoped_timer {
+    public:
+        scoped_timer(const string& name, profiler& p = global_profiler())
+            : name(name), owner(p), start(timer_clock::now()), depth(timer_depth()++) {}
+
+        ~scoped_timer() {
+            timer_depth()--;
+            owner.record(name, start, timer_clock::now(), depth);
+        }
+
+        /** @return the seconds since the timer started */
+        double elapsed() const {
+            return std::chrono::duration<double>(timer_clock::now() - start).count();
+        }
+
+    private:
+        string name;
+        profiler& owner;
+        timer_clock::time_point start;
+        int depth;
+};
+
+/**
+ * Stores a finished timing
+ * @param depth: how many timers were running on the thread when this one started
+ */
+void profiler::record(const string& name, timer_clock::time_point start, timer_clock::time_point end, int depth) {
+    timer_event event;
+    event.name = name;
+    event.start = std::chrono::duration<double>(start - origin).count();
+    event.seconds = std::chrono::duration<double>(end - start).count();
+    event.thread = timer_thread_id();
+    event.depth = depth;
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back(event);
+}
+
+/**
+ * @return the seconds spent in every timing with the given name
+ */
+double profiler::total_seconds(const string& name) const {
+    std::lock_guard<std::mutex> guard(lock);
+    double total = 0;
+    for (int e = 0; e < (int) events.size(); e++) {
+        if (events[e].name == name) {
+            total += events[e].seconds;
+        }
+    }
+    return total;
+}
+
+/**
+ * Prints one row per name, in the order the names first started, with the number of timings, their total and
+ * average time, and the share of the run so far. Nested names are indented under the ones they ran inside.
+ * @param out: the stream to print to
+ */
+void profiler::print_summary(std::ostream& out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    double run = std::chrono::duration<double>(timer_clock::now() - origin).count();
+
+    // group the events by name, keeping the order of the first start
+    vector<const timer_event*> firsts;
+    vector<int> counts;
+    vector<double> totals;
+    for (int e = 0; e < (int) events.size(); e++) {
+        int row = 0;
+        while (row < (int) firsts.size() && firsts[row]->name != events[e].name) {
+            row++;
+        }
+        if (row == (int) firsts.size()) {
+            firsts.push_back(&events[e]);
+            counts.push_back(0);
+            totals.push_back(0);
+        } else if (events[e].start < firsts[row]->start) {
+            firsts[row] = &events[e];
+        }
+        counts[row]++;
+        totals[row] += events[e].seconds;
+    }
+    vector<int> order(firsts.size());
+    for (int row = 0; row < (int) order.size(); row++) {
+        order[row] = row;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return firsts[a]->start < firsts[b]->start; });
+
+    char line[128];
+    snprintf(line, sizeof(line), "%-28s %8s %12s %12s %8s\n", "phase", "calls", "total (s)", "mean (ms)", "% run");
+    out << "\n" << line;
+    for (int k = 0; k < (int) order.size(); k++) {
+        int row = order[k];
+        string name = string(2 * firsts[row]->depth, ' ') + firsts[row]->name;
+        snprintf(line, sizeof(line), "%-28s %8d %12.4f %12.3f %7.1f%%\n", name.c_str(), counts[row], totals[row],
+                 1000 * totals[row] / counts[row], run > 0 ? 100 * totals[row] / run : 0.0);
+        out << line;
+    }
+    snprintf(line, sizeof(line), "%-28s %8s %12.4f\n", "run", "", run);
+    out << line;
+}
+
+/**
+ * Writes every timing as a complete event of the Chrome trace event format,
+ * which can be opened in chrome://tracing or Perfetto
+ * @param filename: the json file to write
+ * @return false if the file could not be written
+ */
+bool profiler::write_trace(const string& filename) const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ofstream out(filename);
+    out << "{\"traceEvents\":[\n";
+    for (int e = 0; e < (int) events.size(); e++) {
+        char line[256];
+        snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}%s\n",
+                 events[e].name.c_str(), 1e6 * events[e].start, 1e6 * events[e].seconds, events[e].thread,
+                 e + 1 < (int) events.size() ? "," : "");
+        out << line;
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}\n";
+    return (bool) out;
+}
+
+#endif
\ No newline at end of file
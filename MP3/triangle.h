@@ -50,6 +50,9 @@ class triangle : public objs {
         vec3 surface_normal(const point3 position) const;
         vec3 interpolated_normal(const point3 position) const;
         bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        bool occluded(const ray& r, double tmin, double tmax) const;
+        void finalize_hit(const ray& r, hit_record& rec) const;
+        bool hit_distance(const ray& r, double tmin, double tmax, double& t, double& u, double& v) const;
         aabb create_aabb() const;
         void set_vertex_normals(const vec3& a, const vec3& b, const vec3& c);
         vec3 barycentric_coordinates(const point3 position) const;
@@ -93,9 +96,47 @@ vec3 triangle::interpolated_normal(const point3 position) const {
     return normal_a * bc[0] + normal_b * bc[1] + normal_c * bc[2];
 }
 
-bool triangle::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
-    vec3 e1 = b - a;
-    vec3 e2 = c - a;
+/**
+ * Creates the bounding box around the triangle (a, b, c). Flat sides are padded slightly
+ * so the box never has zero thickness.
+ * @return the bounding box
+ */
+inline aabb triangle_bounds(const point3& a, const point3& b, const point3& c) {
+    double minx = fmin(fmin(a[0], b[0]), c[0]);
+    double maxx = fmax(fmax(a[0], b[0]), c[0]);
+    double miny = fmin(fmin(a[1], b[1]), c[1]);
+    double maxy = fmax(fmax(a[1], b[1]), c[1]);
+    double minz = fmin(fmin(a[2], b[2]), c[2]);
+    double maxz = fmax(fmax(a[2], b[2]), c[2]);
+
+    double epsilon = 0.0000001;
+    if (minx == maxx) {
+        minx -= epsilon;
+        maxx += epsilon;
+    }
+
+    if (miny == maxy) {
+        miny -= epsilon;
+        maxy += epsilon;
+    }
+
+    if (minz == maxz) {
+        minz -= epsilon;
+        maxz += epsilon;
+    }
+    return aabb(vec3(minx, miny, minz), vec3(maxx, maxy, maxz));
+}
+
+/**
+ * Moller-Trumbore intersection test between a ray and the triangle (x, y, z)
+ * @param t: set to the distance along the ray if it hits
+ * @param u, v: set to the barycentric coordinates of the hit for the y and z vertices
+ * @return true if the ray hits the triangle between tmin and tmax
+ */
+inline bool intersect_triangle(const ray& r, const point3& x, const point3& y, const point3& z,
+                               double tmin, double tmax, double& t, double& u, double& v) {
+    vec3 e1 = y - x;
+    vec3 e2 = z - x;
     vec3 q = cross(r.direction(), e2);
 
     double p = dot(e1, q);
@@ -104,55 +145,61 @@ bool triangle::ray_intersection(const ray& r, hit_record& rec, double tmin, doub
     }
 
     double f = 1/p;
-    vec3 s = r.origin() - a;
-    double u = f * dot(s, q);
+    vec3 s = r.origin() - x;
+    u = f * dot(s, q);
 
     if (u < 0.0) {
         return false;
     }
 
-    vec3 x = cross(s, e1);
-    double v = f * dot(r.direction(), x);
+    vec3 w = cross(s, e1);
+    v = f * dot(r.direction(), w);
     if (v < 0.0 || (u + v) > 1.0) {
         return false;
     }
-    double t = f * dot(e2, x);
-    if (t < tmin || t > tmax) {
+    t = f * dot(e2, w);
+    return t >= tmin && t <= tmax;
+}
+
+/**
+ * Intersection test between the ray and the triangle
+ * @param t: set to the distance along the ray if it hits
+ * @param u, v: set to the barycentric coordinates of the hit for the b and c vertices
+ * @return true if the ray hits the triangle between tmin and tmax
+ */
+bool triangle::hit_distance(const ray& r, double tmin, double tmax, double& t, double& u, double& v) const {
+    return intersect_triangle(r, a, b, c, tmin, tmax, t, u, v);
+}
+
+bool triangle::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    COUNT_RAY_STAT(triangle_tests, 1);
+    double t, u, v;
+    if (!hit_distance(r, tmin, tmax, t, u, v)) {
         return false;
     }
     rec.t = t;
-    rec.p = r.at(t);
-    // rec.set_normal(r, interpolated_normal(rec.p));
+    rec.u = u;
+    rec.v = v;
+    rec.object = this;
+    return true;
+}
+
+void triangle::finalize_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    // rec.set_normal(r, unit_vector(normal_a * (1 - rec.u - rec.v) + normal_b * rec.u + normal_c * rec.v));
     rec.set_normal(r, surface_normal(rec.p));
     rec.kD = kD;
     rec.mat = m;
-    return true;
 }
 
-aabb triangle::create_aabb() const {
-    double minx = fmin(fmin(a[0], b[0]), c[0]);
-    double maxx = fmax(fmax(a[0], b[0]), c[0]);
-    double miny = fmin(fmin(a[1], b[1]), c[1]);
-    double maxy = fmax(fmax(a[1], b[1]), c[1]);
-    double minz = fmin(fmin(a[2], b[2]), c[2]);
-    double maxz = fmax(fmax(a[2], b[2]), c[2]);
-
-    double epsilon = 0.0000001;
-    if (minx == maxx) {
-        minx -= epsilon;
-        maxx += epsilon;
-    }
-
-    if (miny == maxy) {
-        miny -= epsilon;
-        maxy += epsilon;
-    }
+bool triangle::occluded(const ray& r, double tmin, double tmax) const {
+    COUNT_RAY_STAT(triangle_tests, 1);
+    double t, u, v;
+    return hit_distance(r, tmin, tmax, t, u, v);
+}
 
-    if (minz == maxz) {
-        minz -= epsilon;
-        maxz += epsilon;
-    }
-    return aabb(vec3(minx, miny, minz), vec3(maxx, maxy, maxz));
+aabb triangle::create_aabb() const {
+    return triangle_bounds(a, b, c);
 }
 
 /**
@@ -0,0 +1,215 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "objs.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "material.h"
+#include "triangle.h"
+#include "parallel.h"
+#include <vector>
+
+using std::vector;
+
+class triangle_mesh;
+
+/**
+ * A single triangle of a triangle_mesh. It only stores which mesh it belongs to and its index,
+ * and reads its vertices from the mesh's shared buffers.
+ */
+class mesh_triangle : public objs {
+    public:
+        mesh_triangle() {};
+        mesh_triangle(const triangle_mesh* m, int i) : mesh(m), index(i) {}
+
+        std::string type() const {
+            return "mesh triangle";
+        }
+
+        color kDiffuse() const;
+        vec3 surface_normal(const point3 position) const;
+        aabb bounding_box() const;
+        bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        bool occluded(const ray& r, double tmin, double tmax) const;
+        void finalize_hit(const ray& r, hit_record& rec) const;
+
+    public:
+        const triangle_mesh* mesh;
+        int index;
+};
+
+/**
+ * Triangle mesh that stores every vertex position and normal once, with three indices per triangle
+ * pointing into them. The BVH is built over the mesh_triangle list, which refers to triangles by index.
+ */
+class triangle_mesh {
+    public:
+        /**
+         * Constructor for a triangle mesh
+         * @param vertex_positions: the position of every vertex
+         * @param vertex_indices: three indices into vertex_positions for every triangle
+         * @param kDiffuse: the color to shade the mesh
+         * @param mat: the material of the mesh
+         * @param threads: the number of threads to compute the vertex normals with, 0 for every core
+         */
+        triangle_mesh(const vector<point3>& vertex_positions, const vector<int>& vertex_indices,
+                      const color& kDiffuse, material* mat, int threads = 0);
+
+        /**
+         * Constructor for a triangle mesh whose vertex normals are already known
+         * @param vertex_normals: the normal of every vertex
+         */
+        triangle_mesh(const vector<point3>& vertex_positions, const vector<int>& vertex_indices,
+                      const vector<vec3>& vertex_normals, const color& kDiffuse, material* mat);
+
+        // every triangle points back at its mesh, so a mesh cannot be copied
+        triangle_mesh(const triangle_mesh&) = delete;
+        triangle_mesh& operator=(const triangle_mesh&) = delete;
+
+        int size() const {
+            return indices.size() / 3;
+        }
+
+        const point3& vertex(int triangle, int corner) const {
+            return positions[indices[3 * triangle + corner]];
+        }
+
+        const vec3& vertex_normal(int triangle, int corner) const {
+            return normals[indices[3 * triangle + corner]];
+        }
+
+        vector<objs*> get_faces();
+        void calculate_normals(int threads = 0);
+        void set_vertex_normals(const vector<vec3>& vertex_normals, const vector<int>& normal_indices);
+
+    public:
+        vector<point3> positions;
+        vector<vec3> normals;
+        vector<int> indices;
+        vector<mesh_triangle> triangles;
+        color kD;
+        material* m;
+};
+
+triangle_mesh::triangle_mesh(const vector<point3>& vertex_positions, const vector<int>& vertex_indices,
+                             const color& kDiffuse, material* mat, int threads) : positions(vertex_positions), indices(vertex_indices), kD(kDiffuse), m(mat) {
+    triangles.resize(size());
+    for (int i = 0; i < size(); i++) {
+        triangles[i] = mesh_triangle(this, i);
+    }
+    calculate_normals(threads);
+}
+
+triangle_mesh::triangle_mesh(const vector<point3>& vertex_positions, const vector<int>& vertex_indices, const vector<vec3>& vertex_normals,
+                             const color& kDiffuse, material* mat) : positions(vertex_positions), normals(vertex_normals), indices(vertex_indices), kD(kDiffuse), m(mat) {
+    triangles.resize(size());
+    for (int i = 0; i < size(); i++) {
+        triangles[i] = mesh_triangle(this, i);
+    }
+}
+
+/**
+ * @return pointers to every triangle in the mesh, to build a BVH over
+ */
+vector<objs*> triangle_mesh::get_faces() {
+    vector<objs*> faces(triangles.size());
+    for (int i = 0; i < (int) triangles.size(); i++) {
+        faces[i] = &triangles[i];
+    }
+    return faces;
+}
+
+/**
+ * Compute the per vertex normals using area weighted averaging of the surrounding triangle faces.
+ * Each thread accumulates its share of the triangles into its own buffer, and the buffers are then
+ * summed and normalized in parallel over the vertices.
+ * @param threads: the number of threads to use, 0 for every core
+ */
+void triangle_mesh::calculate_normals(int threads) {
+    int vertex_count = positions.size();
+    threads = std::min(thread_count(threads), std::max(size() / 16384, 1));
+    vector<vector<vec3>> partial(threads);
+
+    parallel_for(0, size(), threads, [&](int first, int last, int thread) {
+        vector<vec3>& sums = partial[thread];
+        sums.assign(vertex_count, vec3(0, 0, 0));
+        for (int i = first; i < last; i++) {
+            // the cross product's length is twice the triangle's area
+            vec3 normal = 0.5 * cross(vertex(i, 1) - vertex(i, 0), vertex(i, 2) - vertex(i, 0));
+            for (int corner = 0; corner < 3; corner++) {
+                sums[indices[3 * i + corner]] += normal;
+            }
+        }
+    });
+
+    normals.resize(vertex_count);
+    parallel_for(0, vertex_count, threads, [&](int first, int last, int) {
+        for (int v = first; v < last; v++) {
+            vec3 sum = vec3(0, 0, 0);
+            for (int t = 0; t < (int) partial.size(); t++) {
+                if (!partial[t].empty()) {
+                    sum += partial[t][v];
+                }
+            }
+            normals[v] = unit_vector(sum);
+        }
+    });
+}
+
+/**
+ * Replaces the computed normals with normals given per triangle corner, such as the vn normals of an obj file.
+ * Corners without a normal keep their computed one.
+ * @param vertex_normals: the normals to choose from
+ * @param normal_indices: for each triangle corner, the index of its normal or -1
+ */
+void triangle_mesh::set_vertex_normals(const vector<vec3>& vertex_normals, const vector<int>& normal_indices) {
+    for (int i = 0; i < (int) indices.size() && i < (int) normal_indices.size(); i++) {
+        if (normal_indices[i] >= 0) {
+            normals[indices[i]] = unit_vector(vertex_normals[normal_indices[i]]);
+        }
+    }
+}
+
+color mesh_triangle::kDiffuse() const {
+    return mesh->kD;
+}
+
+/** the position is not used, only there to match the function structure **/
+vec3 mesh_triangle::surface_normal(const point3 position) const {
+    const point3& a = mesh->vertex(index, 0);
+    return unit_vector(cross(mesh->vertex(index, 1) - a, mesh->vertex(index, 2) - a));
+}
+
+aabb mesh_triangle::bounding_box() const {
+    return triangle_bounds(mesh->vertex(index, 0), mesh->vertex(index, 1), mesh->vertex(index, 2));
+}
+
+bool mesh_triangle::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    COUNT_RAY_STAT(triangle_tests, 1);
+    double t, u, v;
+    if (!intersect_triangle(r, mesh->vertex(index, 0), mesh->vertex(index, 1), mesh->vertex(index, 2), tmin, tmax, t, u, v)) {
+        return false;
+    }
+    rec.t = t;
+    rec.u = u;
+    rec.v = v;
+    rec.object = this;
+    return true;
+}
+
+bool mesh_triangle::occluded(const ray& r, double tmin, double tmax) const {
+    COUNT_RAY_STAT(triangle_tests, 1);
+    double t, u, v;
+    return intersect_triangle(r, mesh->vertex(index, 0), mesh->vertex(index, 1), mesh->vertex(index, 2), tmin, tmax, t, u, v);
+}
+
+void mesh_triangle::finalize_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    // rec.set_normal(r, unit_vector(mesh->vertex_normal(index, 0) * (1 - rec.u - rec.v) + mesh->vertex_normal(index, 1) * rec.u + mesh->vertex_normal(index, 2) * rec.v));
+    rec.set_normal(r, surface_normal(rec.p));
+    rec.kD = mesh->kD;
+    rec.mat = mesh->m;
+}
+
+#endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <random>
 #include "vec3.h"
+#include "rng.h"
 
 /**
  * Generates a random integer between min and max
@@ -37,6 +38,30 @@ inline vec3 random_vec3(double min, double max) {
     return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 }
 
+/**
+ * Generates a random double between 0 and 1 from the given generator
+ * @return the random double
+ **/
+inline double random_double(pcg32& rng) {
+    return rng.next_double();
+}
+
+/**
+ * Generates a random double between min and max from the given generator
+ * @return the random double
+ **/
+inline double random_double(pcg32& rng, double min, double max) {
+    return min + (max-min) * rng.next_double();
+}
+
+/**
+ * Generates a random vec3 from the given generator where all numbers are between max and min
+ * @return the random vec3
+ **/
+inline vec3 random_vec3(pcg32& rng, double min, double max) {
+    return vec3(random_double(rng, min, max), random_double(rng, min, max), random_double(rng, min, max));
+}
+
 /**
  * Generates a random sphere position, where x is [-1.9, 1.9], y is [-1.9, 1.9], and z is [-1, -0.1]
  * @return the random position
@@ -63,4 +88,24 @@ inline vec3 random_unit_vector() {
     return unit_vector(random_in_unit_sphere());
 }
 
+/**
+ * Maps a point in the unit square to a direction uniformly distributed over the unit sphere
+ * @param u, v: numbers in [0, 1)
+ */
+inline vec3 uniform_sphere(double u, double v) {
+    double z = 1 - 2 * u;
+    double r = sqrt(fmax(0.0, 1 - z * z));
+    double phi = 2 * M_PI * v;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+/**
+ * Maps a point in the unit cube to a point uniformly distributed within the unit sphere
+ * @param u, v: numbers in [0, 1) for the direction
+ * @param w: a number in [0, 1) for the distance from the center
+ */
+inline vec3 uniform_ball(double u, double v, double w) {
+    return cbrt(w) * uniform_sphere(u, v);
+}
+
 #endif
\ No newline at end of file
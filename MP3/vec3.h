@@ -78,6 +78,14 @@ class vec3 {
 using point3 = vec3;
 using color = vec3;
 
+/**
+ * A point in the unit square
+ */
+struct sample2 {
+    double x;
+    double y;
+};
+
 
 // vec3 Utility Functions
 
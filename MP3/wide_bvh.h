@@ -0,0 +1,400 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "objs.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "bvh_node.h"
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+/**
+ * A node of a wide BVH holding the boxes of up to N children in structure-of-arrays form,
+ * so a ray can be tested against all of them at once with SIMD instructions.
+ */
+template <int N>
+struct wide_bvh_node {
+    static_assert(N % 4 == 0, "wide BVH nodes hold a multiple of 4 children");
+
+    /** the bounding boxes of the children, one array per axis */
+    alignas(32) float min_x[N];
+    alignas(32) float min_y[N];
+    alignas(32) float min_z[N];
+    alignas(32) float max_x[N];
+    alignas(32) float max_y[N];
+    alignas(32) float max_z[N];
+
+    /** interior child: index of its node. leaf child: index of its first primitive */
+    int child[N];
+
+    /** the number of primitives in a leaf child, 0 for interior children and empty slots */
+    unsigned short count[N];
+};
+
+/**
+ * BVH with 4 (SSE) or 8 (AVX) children per node. The tree is built with bvh_node and then
+ * collapsed so every node holds up to N children, which cuts the tree depth and lets the box tests
+ * for all children run in a single vectorized slab test.
+ */
+template <int N>
+class wide_bvh : public objs {
+    public:
+        wide_bvh() {};
+        wide_bvh(const bvh_node& root);
+
+        std::string type() const {
+            return "wide bvh";
+        }
+
+        color kDiffuse() const {
+            return color(-10,-10,-10);
+        }
+
+        vec3 surface_normal(const point3 position) const {
+            return vec3(-10.0,-10.0,-10.0);
+        }
+
+        aabb bounding_box() const {
+            return bbox;
+        }
+
+        /** hits are finalized by the primitive that was hit */
+        void finalize_hit(const ray& r, hit_record& rec) const {}
+
+        virtual bool ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+    private:
+        int collapse(const bvh_node* tree, int level);
+        int stack_entries() const;
+        int children_intersection(const wide_bvh_node<N>& node, const float origin[3], const float inv_dir[3],
+                                  float tmin, float tmax, float tnear[N]) const;
+
+    public:
+        vector<wide_bvh_node<N>> nodes;
+        vector<objs*> primitives;
+        aabb bbox;
+
+        /** the most nodes on any path from the root */
+        int depth = 0;
+};
+
+/** one entry of the stack used to traverse a wide BVH */
+struct wide_bvh_entry {
+    int child;
+    int count;
+    float tnear;
+};
+
+/** the largest number of entries the traversal stack on the call stack can hold, deeper trees use a heap stack */
+const int wide_bvh_stack_size = 256;
+
+/**
+ * Wide BVH constructor
+ * Collapses the binary tree below root into nodes with up to N children
+ * @param root: the root of a tree built by bvh_node
+ */
+template <int N>
+wide_bvh<N>::wide_bvh(const bvh_node& root) {
+    if (root.left == NULL && !root.is_leaf()) {
+        return;
+    }
+    bbox = root.bounding_box();
+    collapse(&root, 1);
+}
+
+/**
+ * Recursively creates the wide node for the subtree. The children of the binary tree are opened,
+ * largest surface area first, until the node has N children.
+ * @param tree: the root of the binary subtree
+ * @param level: the number of nodes from the root down to and including this one
+ * @return the index of the node that was created
+ */
+template <int N>
+int wide_bvh<N>::collapse(const bvh_node* tree, int level) {
+    vector<const objs*> children;
+    if (is_interior(tree)) {
+        children.push_back(tree->left);
+        children.push_back(tree->right);
+    } else {
+        children.push_back(tree);
+    }
+
+    while (children.size() < N) {
+        int largest = -1;
+        double largest_area = 0;
+        for (int c = 0; c < (int) children.size(); c++) {
+            if (is_interior(children[c]) && (largest < 0 || children[c]->bounding_box().surface_area() > largest_area)) {
+                largest = c;
+                largest_area = children[c]->bounding_box().surface_area();
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        const bvh_node* opened = (const bvh_node*) children[largest];
+        children[largest] = opened->left;
+        children.push_back(opened->right);
+    }
+
+    depth = std::max(depth, level);
+    int index = nodes.size();
+    nodes.push_back(wide_bvh_node<N>());
+    float inf = std::numeric_limits<float>::infinity();
+    for (int c = 0; c < N; c++) {
+        wide_bvh_node<N>& node = nodes[index];
+        if (c >= (int) children.size()) {
+            // empty slots get a box at infinity, which fails the slab test for every ray direction
+            node.min_x[c] = node.min_y[c] = node.min_z[c] = inf;
+            node.max_x[c] = node.max_y[c] = node.max_z[c] = inf;
+            node.child[c] = -1;
+            node.count[c] = 0;
+            continue;
+        }
+
+        aabb box = children[c]->bounding_box();
+        // rounded outward, so a flat box keeps at least one float of thickness
+        node.min_x[c] = float_below(box.min().x());
+        node.min_y[c] = float_below(box.min().y());
+        node.min_z[c] = float_below(box.min().z());
+        node.max_x[c] = float_above(box.max().x());
+        node.max_y[c] = float_above(box.max().y());
+        node.max_z[c] = float_above(box.max().z());
+
+        const bvh_node* subtree = dynamic_cast<const bvh_node*>(children[c]);
+        if (subtree == NULL) {
+            node.child[c] = primitives.size();
+            node.count[c] = 1;
+            primitives.push_back((objs*) children[c]);
+        } else if (subtree->is_leaf()) {
+            node.child[c] = primitives.size();
+            node.count[c] = subtree->primitives.size();
+            primitives.insert(primitives.end(), subtree->primitives.begin(), subtree->primitives.end());
+        } else if (subtree->left == subtree->right) {
+            node.child[c] = primitives.size();
+            node.count[c] = 1;
+            primitives.push_back(subtree->left);
+        } else {
+            // nodes may reallocate during the recursion, so write the index through a fresh reference
+            int child_index = collapse(subtree, level + 1);
+            nodes[index].child[c] = child_index;
+            nodes[index].count[c] = 0;
+        }
+    }
+    return index;
+}
+
+/**
+ * @return the most entries the traversal stack can hold at once. Every node that is visited replaces its
+ * own entry with up to N entries for its children, and the root's entry starts the stack.
+ */
+template <int N>
+int wide_bvh<N>::stack_entries() const {
+    return 1 + depth * (N - 1);
+}
+
+/**
+ * Slab test between the ray and every child box of the node. With SSE the children are tested
+ * four at a time, otherwise one at a time. A ray that only grazes a box still counts.
+ * tmax is kept finite so the empty slots, whose boxes are at infinity, still fail.
+ * @param origin, inv_dir: the ray origin and 1 / r.direction()
+ * @param tnear: filled with the entry distance for each child that is hit
+ * @return a bit mask with bit i set if child i is hit between tmin and tmax
+ */
+template <int N>
+inline int wide_bvh<N>::children_intersection(const wide_bvh_node<N>& node, const float origin[3], const float inv_dir[3],
+                                              float tmin, float tmax, float tnear[N]) const {
+    tmax = std::min(tmax, std::numeric_limits<float>::max());
+    int mask = 0;
+#if defined(__SSE2__)
+    __m128 ox = _mm_set1_ps(origin[0]);
+    __m128 oy = _mm_set1_ps(origin[1]);
+    __m128 oz = _mm_set1_ps(origin[2]);
+    __m128 ix = _mm_set1_ps(inv_dir[0]);
+    __m128 iy = _mm_set1_ps(inv_dir[1]);
+    __m128 iz = _mm_set1_ps(inv_dir[2]);
+    for (int c = 0; c < N; c += 4) {
+        __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x + c), ox), ix);
+        __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x + c), ox), ix);
+        __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y + c), oy), iy);
+        __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y + c), oy), iy);
+        __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z + c), oz), iz);
+        __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z + c), oz), iz);
+        __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)),
+                                  _mm_max_ps(_mm_min_ps(z0, z1), _mm_set1_ps(tmin)));
+        __m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)),
+                                 _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(tmax)));
+        _mm_storeu_ps(tnear + c, enter);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(enter, exit)) << c;
+    }
+#else
+    for (int c = 0; c < N; c++) {
+        float x0 = (node.min_x[c] - origin[0]) * inv_dir[0];
+        float x1 = (node.max_x[c] - origin[0]) * inv_dir[0];
+        float y0 = (node.min_y[c] - origin[1]) * inv_dir[1];
+        float y1 = (node.max_y[c] - origin[1]) * inv_dir[1];
+        float z0 = (node.min_z[c] - origin[2]) * inv_dir[2];
+        float z1 = (node.max_z[c] - origin[2]) * inv_dir[2];
+        float enter = fmaxf(fmaxf(fminf(x0, x1), fminf(y0, y1)), fmaxf(fminf(z0, z1), tmin));
+        float exit = fminf(fminf(fmaxf(x0, x1), fmaxf(y0, y1)), fminf(fmaxf(z0, z1), tmax));
+        tnear[c] = enter;
+        if (enter <= exit) {
+            mask |= 1 << c;
+        }
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX__)
+/**
+ * AVX version of the slab test, testing all 8 children at once
+ */
+template <>
+inline int wide_bvh<8>::children_intersection(const wide_bvh_node<8>& node, const float origin[3], const float inv_dir[3],
+                                              float tmin, float tmax, float tnear[8]) const {
+    tmax = std::min(tmax, std::numeric_limits<float>::max());
+    __m256 ox = _mm256_set1_ps(origin[0]);
+    __m256 oy = _mm256_set1_ps(origin[1]);
+    __m256 oz = _mm256_set1_ps(origin[2]);
+    __m256 ix = _mm256_set1_ps(inv_dir[0]);
+    __m256 iy = _mm256_set1_ps(inv_dir[1]);
+    __m256 iz = _mm256_set1_ps(inv_dir[2]);
+    __m256 x0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_x), ox), ix);
+    __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_x), ox), ix);
+    __m256 y0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_y), oy), iy);
+    __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_y), oy), iy);
+    __m256 z0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_z), oz), iz);
+    __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_z), oz), iz);
+    __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(x0, x1), _mm256_min_ps(y0, y1)),
+                                 _mm256_max_ps(_mm256_min_ps(z0, z1), _mm256_set1_ps(tmin)));
+    __m256 exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(x0, x1), _mm256_max_ps(y0, y1)),
+                                _mm256_min_ps(_mm256_max_ps(z0, z1), _mm256_set1_ps(tmax)));
+    _mm256_storeu_ps(tnear, enter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+}
+#endif
+
+/**
+ * Walks the wide tree with an explicit stack. The children of each node that the ray hits are
+ * pushed farthest first, so they are visited near to far and far children can be culled by the closest hit.
+ */
+template <int N>
+bool wide_bvh<N>::ray_intersection(const ray& r, hit_record& rec, double tmin, double tmax) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    float origin[3] = { r.orig[0], r.orig[1], r.orig[2] };
+    float inv_dir[3] = { 1.0f / r.dir[0], 1.0f / r.dir[1], 1.0f / r.dir[2] };
+
+    wide_bvh_entry local_stack[wide_bvh_stack_size];
+    vector<wide_bvh_entry> heap_stack;
+    wide_bvh_entry* stack = local_stack;
+    if (stack_entries() > wide_bvh_stack_size) {
+        heap_stack.resize(stack_entries());
+        stack = heap_stack.data();
+    }
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, (float) tmin };
+    bool hit = false;
+    while (stack_size > 0) {
+        wide_bvh_entry entry = stack[--stack_size];
+        if (hit && entry.tnear > rec.t) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            for (int o = 0; o < entry.count; o++) {
+                if (primitives[entry.child + o]->ray_intersection(r, rec, tmin, hit ? rec.t : tmax)) {
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = nodes[entry.child];
+        float tnear[N];
+        COUNT_RAY_STAT(nodes_visited, 1);
+        COUNT_RAY_STAT(box_tests, N);
+        int mask = children_intersection(node, origin, inv_dir, tmin, hit ? rec.t : tmax, tnear);
+        if (mask == 0) {
+            continue;
+        }
+
+        // insertion sort the hit children by distance, farthest first
+        wide_bvh_entry sorted[N];
+        int hits = 0;
+        for (int c = 0; c < N; c++) {
+            if (mask & (1 << c)) {
+                int k = hits++;
+                while (k > 0 && sorted[k - 1].tnear < tnear[c]) {
+                    sorted[k] = sorted[k - 1];
+                    k--;
+                }
+                sorted[k] = { node.child[c], node.count[c], tnear[c] };
+            }
+        }
+
+        for (int c = 0; c < hits; c++) {
+            stack[stack_size++] = sorted[c];
+        }
+    }
+    return hit;
+}
+
+/**
+ * Walks the wide tree until any primitive is hit between tmin and tmax, without sorting the children
+ */
+template <int N>
+bool wide_bvh<N>::occluded(const ray& r, double tmin, double tmax) const {
+    if (nodes.empty()) {
+        return false;
+    }
+
+    float origin[3] = { r.orig[0], r.orig[1], r.orig[2] };
+    float inv_dir[3] = { 1.0f / r.dir[0], 1.0f / r.dir[1], 1.0f / r.dir[2] };
+
+    wide_bvh_entry local_stack[wide_bvh_stack_size];
+    vector<wide_bvh_entry> heap_stack;
+    wide_bvh_entry* stack = local_stack;
+    if (stack_entries() > wide_bvh_stack_size) {
+        heap_stack.resize(stack_entries());
+        stack = heap_stack.data();
+    }
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, (float) tmin };
+    while (stack_size > 0) {
+        wide_bvh_entry entry = stack[--stack_size];
+        if (entry.count > 0) {
+            for (int o = 0; o < entry.count; o++) {
+                if (primitives[entry.child + o]->occluded(r, tmin, tmax)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = nodes[entry.child];
+        float tnear[N];
+        COUNT_RAY_STAT(nodes_visited, 1);
+        COUNT_RAY_STAT(box_tests, N);
+        int mask = children_intersection(node, origin, inv_dir, tmin, tmax, tnear);
+        for (int c = 0; c < N; c++) {
+            if (mask & (1 << c)) {
+                stack[stack_size++] = { node.child[c], node.count[c], tnear[c] };
+            }
+        }
+    }
+    return false;
+}
+
+#endif